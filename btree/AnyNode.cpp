@@ -55,13 +55,28 @@ GuardX<AnyNode> AnyNode::allocLeaf() {
 }
 
 GuardX<AnyNode> AnyNode::allocInner() {
-    return GuardX<AnyNode>::alloc();
+    return GuardX<AnyNode>::allocPinned();
 }
 
 bool AnyNode::isAnyInner() {
     return isInner(tag());
 }
 
+PageGap AnyNode::gap() {
+    // not tag(), the page may be a metadata page
+    switch (_tag_and_dirty.tag()) {
+        case Tag::Inner:
+        case Tag::Leaf:
+            return {basic()->dataOffset - basic()->freeSpace(), basic()->dataOffset};
+        case Tag::Hash:
+            return {hash()->dataOffset - hash()->freeSpace(), hash()->dataOffset};
+        case Tag::Dense2:
+            return {dense()->slotEndOffset(), dense()->dataOffset};
+        default:
+            return {0, 0};
+    }
+}
+
 
 PID AnyNode::lookupInner(std::span<uint8_t> key) {
     switch (tag()) {
@@ -164,6 +179,80 @@ bool AnyNode::splitNodeWithParent(AnyNode *parent, std::span<uint8_t> key) {
     ASSUME(false);
 }
 
+bool AnyNode::remove(std::span<uint8_t> key) {
+    switch (tag()) {
+        case Tag::Leaf:
+            return basic()->remove(key);
+        case Tag::Hash:
+            return hash()->remove(key.data(), key.size());
+        case Tag::Dense:
+        case Tag::Dense2:
+            return dense()->remove(key);
+        case Tag::Inner:
+            ASSUME(false);
+    }
+    ASSUME(false);
+}
+
+bool AnyNode::isUnderfull() {
+    switch (tag()) {
+        case Tag::Leaf:
+        case Tag::Inner:
+            return basic()->is_underfull();
+        case Tag::Hash:
+            return hash()->is_underfull();
+        case Tag::Dense:
+        case Tag::Dense2:
+            return dense()->is_underfull();
+    }
+    ASSUME(false);
+}
+
+bool AnyNode::tryConvertToBasic() {
+    switch (tag()) {
+        case Tag::Leaf:
+            return true;
+        case Tag::Hash:
+            return hash()->tryConvertToBasic();
+        case Tag::Dense:
+        case Tag::Dense2:
+            if (dense()->basicSize() > pageSizeLeaf)
+                return false;
+            dense()->convertToBasic();
+            return true;
+        case Tag::Inner:
+            ASSUME(false);
+    }
+    ASSUME(false);
+}
+
+// the leaf as a basic node, other layouts are converted in copy. Returns nullptr if it does not fit into one.
+static BTreeNode *basicLeaf(AnyNode *node, TmpBTreeNode &copy) {
+    if (node->tag() == Tag::Leaf)
+        return node->basic();
+    memcpy(copy._bytes, (void *) node, pageSizeLeaf);
+    AnyNode *converted = reinterpret_cast<AnyNode *>(copy._bytes);
+    return converted->tryConvertToBasic() ? converted->basic() : nullptr;
+}
+
+bool AnyNode::mergeNodes(unsigned slotId, AnyNode *parent, AnyNode *right) {
+    if (tag() == Tag::Inner)
+        return basic()->mergeNodes(slotId, parent, right->basic());
+    if (tag() == Tag::Hash && right->tag() == Tag::Hash)
+        return hash()->mergeNodes(slotId, parent, right->hash());
+    // merge basic copies, a merge that does not fit leaves both leaves in their layout
+    TmpBTreeNode leftCopy;
+    TmpBTreeNode rightCopy;
+    TmpBTreeNode merged;
+    BTreeNode *left = basicLeaf(this, leftCopy);
+    BTreeNode *rightBasic = basicLeaf(right, rightCopy);
+    if (!left || !rightBasic || !left->buildMerged(rightBasic, merged.node))
+        return false;
+    parent->basic()->removeSeparator(slotId, bm.toPID(this));
+    memcpy((void *) this, &merged.node, pageSizeLeaf);
+    return true;
+}
+
 
 GuardX<AnyNode> AnyNode::makeRoot(PID child) {
     auto new_root = allocInner();
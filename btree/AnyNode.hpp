@@ -28,6 +28,9 @@ union AnyNode {
 
     bool isAnyInner();
 
+    // free space between slots and heap, empty for node types without one. Also called on pages that are not nodes.
+    PageGap gap();
+
     BTreeNode *basic();
 
     DenseNode *dense();
@@ -58,6 +61,19 @@ union AnyNode {
 
     bool splitNodeWithParent(AnyNode *parent, std::span<uint8_t> key);
 
+    // remove a key from a leaf, returns false if it is not present
+    bool remove(std::span<uint8_t> key);
+
+    // the node uses less than a quarter of a page, leaves converted to a basic node
+    bool isUnderfull();
+
+    // Merge the sibling right into this node, see BTreeNode::mergeNodes. Hash leaves stay hash nodes, other leaf
+    // combinations are merged into a basic node. Both are left unchanged if the merge does not fit.
+    bool mergeNodes(unsigned slotId, AnyNode *parent, AnyNode *right);
+
+    // convert a leaf to a basic node if it fits into one
+    bool tryConvertToBasic();
+
     void nodeCount(unsigned counts[TAG_END]);
 };
 
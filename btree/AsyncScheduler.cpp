@@ -0,0 +1,83 @@
+#include "AsyncScheduler.hpp"
+#include "common.hpp"
+
+AsyncScheduler::AsyncScheduler(unsigned width) : width(width), running(0) {
+    if (width == 0) {
+        std::cerr << "AsyncScheduler needs a width of at least 1" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    ready.reserve(width);
+    resuming.reserve(width);
+    waiting.reserve(width);
+}
+
+AsyncScheduler::~AsyncScheduler() {
+    drain();
+}
+
+unsigned AsyncScheduler::configuredWidth() {
+    static const unsigned width = envOr("CORO", 0);
+    return width;
+}
+
+AsyncScheduler::Task AsyncScheduler::run(std::function<void()> op) {
+    while (true) {
+        PID pid = 0;
+        try {
+            op();
+            break;
+        } catch (const PageFaultSuspend &fault) {
+            pid = fault.pid;
+        }
+        co_await PageAwaiter{*this, pid};
+    }
+    running--;
+}
+
+void AsyncScheduler::submit(std::function<void()> op) {
+    running++;
+    ready.push_back(run(std::move(op)).handle);
+    while (running >= width)
+        step(width);
+}
+
+void AsyncScheduler::drain() {
+    while (running > 0)
+        step(1);
+    // reads prefetched by scans that returned
+    bm.pollReads(true);
+}
+
+void AsyncScheduler::step(unsigned limit) {
+    // operations suspended while these run are put into waiting
+    std::swap(ready, resuming);
+    suspendFaults = true;
+    for (std::coroutine_handle<> handle: resuming) {
+        handle.resume();
+        if (handle.done())
+            handle.destroy();
+    }
+    suspendFaults = false;
+    resuming.clear();
+
+    bm.pollReads(false);
+    while (true) {
+        for (u64 i = 0; i < waiting.size();) {
+            u64 v = bm.getPageState(waiting[i].pid).stateAndVersion.load();
+            if (PageState::getState(v) != PageState::Locked) {
+                ready.push_back(waiting[i].handle);
+                waiting[i] = waiting.back();
+                waiting.pop_back();
+            } else {
+                i++;
+            }
+        }
+        if (!ready.empty() || running < limit)
+            return;
+        // nothing to run, block until one of our reads completes
+        if (asyncReadsInFlight)
+            bm.pollReads(true, false);
+        else
+            vmcache_yield();
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef BTREE24_ASYNCSCHEDULER_HPP
+#define BTREE24_ASYNCSCHEDULER_HPP
+
+#include <coroutine>
+#include <functional>
+#include <vector>
+#include "vmache.hpp"
+
+// Interleaves the operations of one worker thread, enabled by setting CORO to the number of operations a worker
+// keeps in flight. Each operation runs as a coroutine. When its optimistic descent hits an evicted page, the read is
+// submitted asynchronously and the operation is suspended (PageFaultSuspend), the worker runs other operations until
+// the page is resident. Operations hold no locks when they are suspended, they restart from the root when resumed.
+// Faults of locked accesses and of scans that already invoked callbacks block the thread as before.
+struct AsyncScheduler {
+    // coroutine running one operation, started by the scheduler
+    struct Task {
+        struct promise_type {
+            Task get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+
+            std::suspend_always final_suspend() noexcept { return {}; }
+
+            void return_void() {}
+
+            void unhandled_exception() { abort(); }
+        };
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    // suspends the operation until pid is no longer locked
+    struct PageAwaiter {
+        AsyncScheduler &scheduler;
+        PID pid;
+
+        bool await_ready() { return false; }
+
+        void await_suspend(std::coroutine_handle<> handle) { scheduler.waiting.push_back({handle, pid}); }
+
+        void await_resume() {}
+    };
+
+    struct Waiter {
+        std::coroutine_handle<> handle;
+        PID pid;
+    };
+
+    unsigned width;
+    unsigned running;
+    std::vector<std::coroutine_handle<>> ready;
+    std::vector<std::coroutine_handle<>> resuming;
+    std::vector<Waiter> waiting;
+
+    explicit AsyncScheduler(unsigned width);
+
+    ~AsyncScheduler();
+
+    // Start an operation. Returns once fewer than width operations are in flight, operations may complete in any
+    // order. op must not throw anything but PageFaultSuspend, it may run multiple times.
+    void submit(std::function<void()> op);
+
+    // run until all submitted operations completed
+    void drain();
+
+    // CORO, 0 runs operations directly
+    static unsigned configuredWidth();
+
+private:
+    Task run(std::function<void()> op);
+
+    // resume the ready operations, then wait until one can continue while limit or more are in flight
+    void step(unsigned limit);
+};
+
+#endif //BTREE24_ASYNCSCHEDULER_HPP
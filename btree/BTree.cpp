@@ -6,6 +6,9 @@
 #include "DenseNode.hpp"
 #include "AnyNode.hpp"
 #include "common.hpp"
+#include "WriteAheadLog.hpp"
+#include <barrier>
+#include <thread>
 
 
 struct MetaDataPage : public TagAndDirty {
@@ -24,10 +27,24 @@ BTree::~BTree() {
 
 // take isInt to have same interface as in memory structures, but ignore it.
 BTree::BTree(bool isInt) {
+    treeIndex = bm.registerTree();
+    TreeScope scope(treeIndex);
+    bm.store.pageGap = [](PID, Page *page) { return reinterpret_cast<AnyNode *>(page)->gap(); };
+    if (bm.reopened) {
+        metadataPid = bm.getTreeAnchor(treeIndex);
+        wal.replay(treeIndex, bm.superblock.checkpointLsn, [&](auto type, auto key, auto payload) {
+            if (type == WriteAheadLog::Insert)
+                insertImpl(key, payload);
+            else
+                removeImpl(key);
+        });
+        return;
+    }
     auto root = (enableHash && !enableHashAdapt) ? HashNode::makeRootLeaf() : BTreeNode::makeLeaf();
-    auto metadata = GuardX<MetaDataPage>::alloc();
+    auto metadata = GuardX<MetaDataPage>::allocPinned();
     metadata->root = root.pid();
     this->metadataPid = metadata.pid();
+    bm.setTreeAnchor(treeIndex, metadataPid);
 #ifndef NDEBUG
     // prevent print from being optimized out. It is otherwise never called, but nice for debugging
     if (getenv("oMEeHAobn4")) {
@@ -38,6 +55,7 @@ BTree::BTree(bool isInt) {
 
 void BTree::insertImpl(std::span<uint8_t> key, std::span<uint8_t> payload) {
     assert((key.size() + payload.size()) <= BTreeNode::maxKVSize);
+    TreeScope scope(treeIndex);
     while (true) {
         try {
             GuardO<AnyNode> parent{metadataPid};
@@ -55,6 +73,7 @@ void BTree::insertImpl(std::span<uint8_t> key, std::span<uint8_t> payload) {
                     case Tag::Leaf: {
                         if (nodeLocked->basic()->insert(key, payload)) {
                             parent.release_ignore();
+                            wal.logAndRelease(nodeLocked, WriteAheadLog::Insert, treeIndex, key, payload);
                             return;
                         }
                         break;
@@ -63,6 +82,7 @@ void BTree::insertImpl(std::span<uint8_t> key, std::span<uint8_t> payload) {
                     case Tag::Dense2: {
                         if (nodeLocked->dense()->insert(key, payload)) {
                             parent.release_ignore();
+                            wal.logAndRelease(nodeLocked, WriteAheadLog::Insert, treeIndex, key, payload);
                             return;
                         }
                         break;
@@ -74,6 +94,7 @@ void BTree::insertImpl(std::span<uint8_t> key, std::span<uint8_t> payload) {
                             continue;
                         if (nodeLocked->hash()->insert(key, payload)) {
                             parent.release_ignore();
+                            wal.logAndRelease(nodeLocked, WriteAheadLog::Insert, treeIndex, key, payload);
                             return;
                         }
                         break;
@@ -93,14 +114,23 @@ void BTree::insertImpl(std::span<uint8_t> key, std::span<uint8_t> payload) {
 
 
 void BTree::trySplit(GuardX<AnyNode> node, GuardX<AnyNode> parent, std::span<uint8_t> key) {
-    // create new root if necessary
-    if (parent.pid() == metadataPid) {
-        MetaDataPage *metaData = reinterpret_cast<MetaDataPage *>(parent.ptr);
-        auto newRoot = AnyNode::makeRoot(node.pid());
-        metaData->root = newRoot.pid();
-        parent = std::move(newRoot);
+    bool split;
+    {
+        // the metadata page stays locked until the split is logged
+        GuardX<AnyNode> metaData;
+        WriteAheadLog::StructureScope structure(treeIndex, {node.pid(), parent.pid()});
+        // create new root if necessary
+        if (parent.pid() == metadataPid) {
+            auto newRoot = AnyNode::makeRoot(node.pid());
+            reinterpret_cast<MetaDataPage *>(parent.ptr)->root = newRoot.pid();
+            metaData = std::move(parent);
+            parent = std::move(newRoot);
+        }
+        split = node->splitNodeWithParent(parent.ptr, key);
+        if (!split && !metaData.ptr)
+            structure.cancel();
     }
-    if (!node->splitNodeWithParent(parent.ptr, key)) {
+    if (!split) {
         auto parentPid = parent.pid();
         parent.release();
         node.release();
@@ -125,7 +155,106 @@ void BTree::ensureSpace(PID innerNode, std::span<uint8_t> key) {
     };
 }
 
+bool BTree::removeImpl(std::span<uint8_t> key) {
+    TreeScope scope(treeIndex);
+    while (true) {
+        try {
+            GuardO<AnyNode> parent{metadataPid};
+            GuardO<AnyNode> node(reinterpret_cast<MetaDataPage *>(parent.ptr)->root, parent);
+
+            while (node->isAnyInner()) {
+                parent = std::move(node);
+                node = GuardO<AnyNode>(parent->lookupInner(key), parent);
+            }
+
+            parent.checkVersionAndRestart();
+            GuardX<AnyNode> nodeLocked{std::move(node)};
+            if (nodeLocked->tag() == Tag::Hash)
+                nodeLocked->hash()->rangeOpCounter.point_op();
+            if (!nodeLocked->remove(key)) {
+                parent.release_ignore();
+                return false;
+            }
+            bool underfull = parent.pid() != metadataPid && nodeLocked->isUnderfull();
+            parent.release_ignore();
+            wal.logAndRelease(nodeLocked, WriteAheadLog::Remove, treeIndex, key, {});
+            if (underfull)
+                tryMerge(key);
+            return true;
+        } catch (const OLCRestartException &) { vmcache_yield(); }
+    }
+}
+
+void BTree::tryMerge(std::span<uint8_t> key) {
+    // the remove already happened, do not rerun it when a node has to be read
+    SuspendFaultsScope suspendScope;
+    suspendFaults = false;
+    PID target = 0;
+    do {
+        target = mergeNode(target, key);
+    } while (target != 0);
+}
+
+PID BTree::mergeNode(PID target, std::span<uint8_t> key) {
+    for (u64 repeatCounter = 0;; repeatCounter++) {
+        try {
+            GuardO<AnyNode> parent{metadataPid};
+            GuardO<AnyNode> node(reinterpret_cast<MetaDataPage *>(parent.ptr)->root, parent);
+            unsigned pos = 0;
+            while (node->isAnyInner() && node.pid() != target) {
+                parent = std::move(node);
+                pos = parent->basic()->lowerBound(key);
+                node = GuardO<AnyNode>(parent->lookupInner(key), parent);
+            }
+            if (target != 0 && node.pid() != target)
+                return 0; // merged concurrently
+
+            if (parent.pid() == metadataPid) {
+                // an inner root left with a single child is replaced by that child
+                if (!node->isAnyInner() || node->basic()->count > 0)
+                    return 0;
+                GuardX<AnyNode> metaLocked(std::move(parent));
+                GuardX<AnyNode> rootLocked(std::move(node));
+                WriteAheadLog::StructureScope structure(treeIndex, {metaLocked.pid()});
+                reinterpret_cast<MetaDataPage *>(metaLocked.ptr)->root = rootLocked->basic()->upper;
+                rootLocked.dealloc();
+                return 0;
+            }
+            if (!node->isUnderfull())
+                return 0;
+
+            GuardX<AnyNode> parentLocked(std::move(parent));
+            BTreeNode *inner = parentLocked->basic();
+            if (inner->count == 0)
+                return parentLocked.pid(); // no sibling, the parent has to be merged first
+            // lock left before right, merge into the left node
+            unsigned slotId;
+            GuardX<AnyNode> left;
+            GuardX<AnyNode> right;
+            if (pos < inner->count) {
+                slotId = pos;
+                left = GuardX<AnyNode>(std::move(node));
+                right = GuardX<AnyNode>(pos + 1 == inner->count ? inner->upper : inner->getChild(pos + 1));
+            } else {
+                slotId = pos - 1;
+                left = GuardX<AnyNode>(inner->getChild(pos - 1));
+                right = GuardX<AnyNode>(std::move(node));
+            }
+            {
+                WriteAheadLog::StructureScope structure(treeIndex, {parentLocked.pid(), left.pid()});
+                if (!left->mergeNodes(slotId, parentLocked.ptr, right.ptr)) {
+                    structure.cancel();
+                    return 0;
+                }
+                right.dealloc();
+            }
+            return parentLocked->isUnderfull() ? parentLocked.pid() : 0;
+        } catch (const OLCRestartException &) { vmcache_yield(repeatCounter); }
+    }
+}
+
 void BTree::lookupImpl(std::span<uint8_t> key, std::function<void(std::span<uint8_t>)> callback) {
+    TreeScope scope(treeIndex);
     GuardO<AnyNode> parent{metadataPid};
     GuardO<AnyNode> node(reinterpret_cast<MetaDataPage *>(parent.ptr)->root, parent);
 
@@ -157,14 +286,52 @@ void BTree::lookupImpl(std::span<uint8_t> key, std::function<void(std::span<uint
                 return;
             }
             default:
+                // page was evicted under our optimistic read
+                node.checkVersionAndRestart();
                 ASSUME(false);
         }
         break;
     }
 }
 
+// number of leaves right of the first one a range lookup reads ahead
+static const unsigned scanPrefetchCount = envOr("SCAN_PREFETCH", 0);
+
+static void prefetchRightSiblings(GuardO<AnyNode> &parent, std::span<uint8_t> key) {
+    BTreeNode *inner = parent->basic();
+    // count is read optimistically, a torn one must not take us past the slots of the page
+    const unsigned maxCount = (pageSizeInner - sizeof(BTreeNodeHeader)) / sizeof(BTreeNode::Slot);
+    unsigned count = std::min<unsigned>(inner->count, maxCount);
+    std::vector<PID> pids;
+    for (unsigned i = inner->lowerBound(key) + 1; i <= count && pids.size() < scanPrefetchCount; ++i)
+        pids.push_back(i == count ? inner->upper : inner->getChild(i));
+    parent.checkVersionAndRestart();
+    bm.prefetch(pids);
+}
+
 void BTree::range_lookupImpl(std::span<uint8_t> key, uint8_t *keyOutBuffer,
                              const std::function<bool(unsigned int, std::span<uint8_t>)> &found_record_cb) {
+    TreeScope scope(treeIndex);
+    // leaves read by the scan are hinted once all guards are released
+    struct TouchOnce {
+        std::array<PID, 16> pids;
+        unsigned count = 0;
+
+        ~TouchOnce() {
+            for (unsigned i = 0; i < count; i++)
+                bm.touchOnce(pids[i]);
+        }
+    } touchOnce;
+    // prefetched leaves must not stay locked after we return, unless an AsyncScheduler keeps polling
+    SuspendFaultsScope suspendScope;
+    struct DrainReads {
+        bool polled;
+
+        ~DrainReads() {
+            if (!polled)
+                bm.pollReads(true);
+        }
+    } drainReads{suspendFaults};
     std::array<GuardO<AnyNode>, 10> leafGuards = {GuardO<AnyNode>::released(), GuardO<AnyNode>::released(),
                                                  GuardO<AnyNode>::released(), GuardO<AnyNode>::released(),
                                                  GuardO<AnyNode>::released(), GuardO<AnyNode>::released(),
@@ -182,10 +349,16 @@ void BTree::range_lookupImpl(std::span<uint8_t> key, uint8_t *keyOutBuffer,
             parent = std::move(node);
             node = GuardO<AnyNode>(parent->lookupInner(key), parent);
         }
+        if (scanPrefetchCount && lockedLeaves == 0 && parent.pid() != metadataPid)
+            prefetchRightSiblings(parent, key);
         parent.release();
+        // only the first descent may suspend, callbacks follow
+        suspendFaults = false;
         if (lockedLeaves >= leafGuards.size()) {
             abort();
         }
+        if (touchOnce.count < touchOnce.pids.size())
+            touchOnce.pids[touchOnce.count++] = node.pid();
         while (true) {
             switch (node->tag()) {
                 case Tag::Leaf: {
@@ -239,6 +412,8 @@ void BTree::range_lookupImpl(std::span<uint8_t> key, uint8_t *keyOutBuffer,
                     break;
                 }
                 default:
+                    // page was evicted under our optimistic read
+                    node.checkVersionAndRestart();
                     ASSUME(false);
             }
             break;
@@ -257,6 +432,320 @@ void BTree::range_lookupImpl(std::span<uint8_t> key, uint8_t *keyOutBuffer,
     }
 }
 
+// percentage of a node bulkLoad fills, the rest is left for later inserts
+static const unsigned bulkFillPercent = [] {
+    uint64_t percent = envOr("BULK_FILL", 90);
+    if (percent < 1 || percent > 100) {
+        std::cerr << "BULK_FILL must be between 1 and 100" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return percent;
+}();
+
+namespace {
+// records of the leaf bulkLoad is building, copied as next may reuse its buffers
+struct BulkRun {
+    struct Entry {
+        unsigned offset;
+        unsigned keyLen;
+        unsigned payloadLen;
+    };
+
+    std::vector<uint8_t> bytes;
+    std::vector<Entry> entries;
+
+    std::span<uint8_t> key(unsigned i) { return {bytes.data() + entries[i].offset, entries[i].keyLen}; }
+
+    std::span<uint8_t> payload(unsigned i) {
+        return {bytes.data() + entries[i].offset + entries[i].keyLen, entries[i].payloadLen};
+    }
+
+    void push(std::span<uint8_t> key, std::span<uint8_t> payload) {
+        if (!entries.empty() && span_compare(this->key(entries.size() - 1), key) >= 0) {
+            std::cerr << "bulk load keys must be strictly increasing" << std::endl;
+            abort();
+        }
+        entries.push_back({static_cast<unsigned>(bytes.size()), static_cast<unsigned>(key.size()),
+                           static_cast<unsigned>(payload.size())});
+        bytes.insert(bytes.end(), key.begin(), key.end());
+        bytes.insert(bytes.end(), payload.begin(), payload.end());
+    }
+
+    // drop the first n records
+    void consume(unsigned n) {
+        unsigned start = n == entries.size() ? bytes.size() : entries[n].offset;
+        bytes.erase(bytes.begin(), bytes.begin() + start);
+        entries.erase(entries.begin(), entries.begin() + n);
+        for (Entry &entry: entries)
+            entry.offset -= start;
+    }
+};
+
+// node of the level below the one bulkLoad is building, upperFence is empty for the last one
+struct BulkChild {
+    std::vector<uint8_t> upperFence;
+    PID pid;
+};
+}
+
+// bytes of an empty node not available for fences and entries
+static unsigned nodeHeaderSize(bool isLeaf) {
+    TmpBTreeNode tmp;
+    tmp.node.init(isLeaf, RangeOpCounter{});
+    return (isLeaf ? pageSizeLeaf : pageSizeInner) - tmp.node.freeSpace();
+}
+
+// shortest separator s with a <= s < b
+static std::span<uint8_t> bulkSeparator(std::span<uint8_t> a, std::span<uint8_t> b) {
+    unsigned common = commonPrefixLength(a, b);
+    if (common + 1 < b.size())
+        return b.subspan(0, common + 1);
+    return a;
+}
+
+// Store the first count records of run in leaf, using the layout inserts and splits would settle on. Returns false if
+// they do not fit.
+static bool buildBulkLeaf(AnyNode &leaf, BulkRun &run, unsigned count, std::span<uint8_t> lowerFence,
+                          std::span<uint8_t> upperFence) {
+    BTreeNode *basic = &leaf._basic_node;
+    basic->init(true, RangeOpCounter{});
+    basic->setFences(lowerFence, upperFence);
+    unsigned needed = 0;
+    for (unsigned i = 0; i < count; i++)
+        needed += basic->spaceNeeded(run.key(i).size(), run.payload(i).size());
+    if (needed > basic->freeSpace())
+        return false;
+    for (unsigned i = 0; i < count; i++) {
+        basic->storeKeyValue(i, run.key(i), run.payload(i));
+        basic->count++;
+    }
+    basic->makeHint();
+    basic->validate();
+
+    if (enableDense || enableDense2) {
+        AnyNode dense;
+        if (dense._dense.try_densify(basic)) {
+            memcpy((void *) &leaf, &dense, pageSizeLeaf);
+            return true;
+        }
+    }
+    if (enableHash && !enableHashAdapt)
+        return basic->tryConvertToHash();
+    if (enableHashAdapt) {
+        if (basic->hasBadHeads()) {
+            basic->rangeOpCounter.setBadHeads();
+            basic->tryConvertToHash();
+        } else {
+            basic->rangeOpCounter.setGoodHeads();
+        }
+    }
+    return true;
+}
+
+// true if the tree has no records and bulkLoad may replace its root
+static bool isEmptyTree(PID metadataPid) {
+    GuardX<MetaDataPage> meta{metadataPid};
+    GuardX<AnyNode> root(meta->root);
+    return (root->tag() == Tag::Leaf && root->basic()->count == 0) ||
+           (root->tag() == Tag::Hash && root->hash()->count == 0);
+}
+
+// Build the leaves for the records returned by next, the first leaf gets lowerFence, the last one upperFence. Appends
+// them to children.
+static void buildBulkLeaves(const std::function<bool(std::span<uint8_t> &key, std::span<uint8_t> &payload)> &next,
+                            std::span<uint8_t> lowerFence, std::span<uint8_t> upperFence,
+                            std::vector<BulkChild> &children) {
+    const unsigned leafBudget = pageSizeLeaf * bulkFillPercent / 100;
+    const unsigned leafHeader = nodeHeaderSize(true);
+    std::vector<uint8_t> lower{lowerFence.begin(), lowerFence.end()};
+    std::span<uint8_t> key;
+    std::span<uint8_t> payload;
+    BulkRun run;
+    bool more = next(key, payload);
+    if (more)
+        run.push(key, payload);
+    while (!run.entries.empty()) {
+        // read until the run exceeds the budget, keeping the record that did as the next leaf's first one
+        unsigned size = leafHeader + lower.size();
+        for (unsigned i = 0; i < run.entries.size(); i++)
+            size += sizeof(BTreeNode::Slot) + run.key(i).size() + run.payload(i).size();
+        while (more && (size <= leafBudget || run.entries.size() < 2)) {
+            more = next(key, payload);
+            if (more) {
+                run.push(key, payload);
+                size += sizeof(BTreeNode::Slot) + key.size() + payload.size();
+            }
+        }
+        unsigned count = run.entries.size();
+        if (size > leafBudget && count > 1)
+            count--;
+
+        AnyNode leaf;
+        std::span<uint8_t> upper;
+        while (true) {
+            upper = count == run.entries.size() ? upperFence : bulkSeparator(run.key(count - 1), run.key(count));
+            if (buildBulkLeaf(leaf, run, count, lower, upper))
+                break;
+            ASSUME(count > 1);
+            count--;
+        }
+        GuardX<AnyNode> page = AnyNode::allocLeaf();
+        memcpy((void *) page.ptr, &leaf, pageSizeLeaf);
+        children.push_back({{upper.begin(), upper.end()}, page.pid()});
+        lower.assign(upper.begin(), upper.end());
+        run.consume(count);
+    }
+}
+
+// Build the level of inner nodes on top of children, the first gets lowerFence. The upper fence of the last child of a
+// node moves up as its separator.
+static std::vector<BulkChild> buildBulkLevel(std::vector<BulkChild> &children, std::span<uint8_t> lowerFence) {
+    const unsigned innerBudget = pageSizeInner * bulkFillPercent / 100;
+    const unsigned innerHeader = nodeHeaderSize(false);
+    std::vector<BulkChild> parents;
+    std::span<uint8_t> lower = lowerFence;
+    for (unsigned first = 0; first < children.size();) {
+        unsigned last = first;
+        unsigned size = innerHeader + lower.size() + children[first].upperFence.size();
+        while (last + 1 < children.size()) {
+            unsigned grown = size + sizeof(BTreeNode::Slot) + sizeof(PID) + children[last + 1].upperFence.size();
+            // do not leave a single child for the last node
+            bool lastChild = last + 2 == children.size();
+            if (grown > innerBudget && !(lastChild && grown <= pageSizeInner))
+                break;
+            size = grown;
+            last++;
+        }
+        GuardX<AnyNode> node = AnyNode::allocInner();
+        BTreeNode *inner = &node->_basic_node;
+        inner->init(false, RangeOpCounter{});
+        inner->setFences(lower, children[last].upperFence);
+        for (unsigned i = first; i < last; i++) {
+            inner->storeKeyValue(i - first, children[i].upperFence,
+                                 {reinterpret_cast<uint8_t *>(&children[i].pid), sizeof(PID)});
+            inner->count++;
+        }
+        inner->upper = children[last].pid;
+        inner->makeHint();
+        inner->validate();
+        parents.push_back({children[last].upperFence, node.pid()});
+        lower = children[last].upperFence;
+        first = last + 1;
+    }
+    return parents;
+}
+
+// build the inner levels on top of children, returns the root
+static PID buildBulkInner(std::vector<BulkChild> children) {
+    while (children.size() > 1)
+        children = buildBulkLevel(children, {});
+    return children[0].pid;
+}
+
+static void replaceRoot(u32 treeIndex, PID metadataPid, PID root) {
+    // the loaded pages are not logged, make them durable before the tree refers to them
+    if (wal.enabled)
+        bm.sync();
+    GuardX<MetaDataPage> meta{metadataPid};
+    WriteAheadLog::StructureScope structure(treeIndex, {metadataPid});
+    GuardX<AnyNode> oldRoot(meta->root);
+    meta->root = root;
+    oldRoot.dealloc();
+}
+
+void BTree::bulkLoad(const std::function<bool(std::span<uint8_t> &key, std::span<uint8_t> &payload)> &next) {
+    TreeScope scope(treeIndex);
+    if (!isEmptyTree(metadataPid)) {
+        std::span<uint8_t> key;
+        std::span<uint8_t> payload;
+        while (next(key, payload))
+            insertImpl(key, payload);
+        return;
+    }
+
+    std::vector<BulkChild> children;
+    buildBulkLeaves(next, {}, {}, children);
+    if (!children.empty())
+        replaceRoot(treeIndex, metadataPid, buildBulkInner(std::move(children)));
+}
+
+void BTree::bulkLoadParallel(uint64_t count, unsigned threadCount, unsigned firstWorkerId,
+                             const std::function<void(uint64_t i, std::span<uint8_t> &key,
+                                                      std::span<uint8_t> &payload)> &record) {
+    TreeScope scope(treeIndex);
+    std::span<uint8_t> key;
+    std::span<uint8_t> payload;
+    if (!isEmptyTree(metadataPid)) {
+        for (uint64_t i = 0; i < count; i++) {
+            record(i, key, payload);
+            insertImpl(key, payload);
+        }
+        return;
+    }
+    if (count == 0)
+        return;
+
+    // split into key ranges at record indices, fences[p] separates part p - 1 from part p
+    // part p > 0 is built with worker id firstWorkerId + p - 1
+    uint64_t freeIds = firstWorkerId < maxWorkerThreads ? maxWorkerThreads - firstWorkerId : 0;
+    unsigned partCount = std::max<uint64_t>(1, std::min<uint64_t>({threadCount, count, freeIds + 1}));
+    std::vector<uint64_t> partStart(partCount + 1);
+    std::vector<std::vector<uint8_t>> fences(partCount + 1);
+    for (unsigned p = 0; p <= partCount; p++)
+        partStart[p] = count * p / partCount;
+    for (unsigned p = 1; p < partCount; p++) {
+        record(partStart[p] - 1, key, payload);
+        std::vector<uint8_t> last{key.begin(), key.end()};
+        record(partStart[p], key, payload);
+        if (span_compare(last, key) >= 0) {
+            std::cerr << "bulk load keys must be strictly increasing" << std::endl;
+            abort();
+        }
+        std::span<uint8_t> separator = bulkSeparator(last, key);
+        fences[p].assign(separator.begin(), separator.end());
+    }
+
+    // Each part builds its subtree on its own thread, the calling thread builds part 0. All leaves must be at the same
+    // depth, so the parts build their inner levels in lock step until one of them is down to a single node. Only the
+    // levels above are built over all parts.
+    std::vector<std::vector<BulkChild>> partChildren(partCount);
+    bool levelsDone = false;
+    std::barrier levelBarrier(partCount, [&]() noexcept {
+        levelsDone = std::any_of(partChildren.begin(), partChildren.end(),
+                                 [](std::vector<BulkChild> &children) { return children.size() <= 1; });
+    });
+    auto buildPart = [&](unsigned p) {
+        TreeScope partScope(treeIndex);
+        uint64_t i = partStart[p];
+        buildBulkLeaves([&](std::span<uint8_t> &nextKey, std::span<uint8_t> &nextPayload) {
+            if (i == partStart[p + 1])
+                return false;
+            record(i++, nextKey, nextPayload);
+            return true;
+        }, fences[p], fences[p + 1], partChildren[p]);
+        while (true) {
+            levelBarrier.arrive_and_wait();
+            if (levelsDone)
+                break;
+            partChildren[p] = buildBulkLevel(partChildren[p], fences[p]);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned p = 1; p < partCount; p++)
+        threads.emplace_back([&, p] {
+            setVmcacheWorkerThreadId(firstWorkerId + p - 1);
+            buildPart(p);
+        });
+    buildPart(0);
+    for (std::thread &thread: threads)
+        thread.join();
+
+    std::vector<BulkChild> children;
+    for (std::vector<BulkChild> &part: partChildren)
+        std::move(part.begin(), part.end(), std::back_inserter(children));
+    replaceRoot(treeIndex, metadataPid, buildBulkInner(std::move(children)));
+}
+
 static void nodeCountVisit(AnyNode &node, std::array<uint32_t, TAG_END + 2> &counts) {
     counts[static_cast<unsigned>(node.tag())] += 1;
     switch (node.tag()) {
@@ -12,6 +12,7 @@ struct BTree {
     ~BTree();
 
     PID metadataPid;
+    unsigned treeIndex;
 
     void lookupImpl(std::span<uint8_t> key, std::function<void(std::span<uint8_t>)> callback);
 
@@ -24,6 +25,28 @@ struct BTree {
 
     void ensureSpace(PID innerNode, std::span<uint8_t> key);
 
+    // returns false if the key is not present
+    bool removeImpl(std::span<uint8_t> key);
+
+    // merge the leaf containing key with a sibling if it is underfull, then its ancestors
+    void tryMerge(std::span<uint8_t> key);
+
+    // Merge target, or the leaf containing key if target is 0, with a sibling. Collapses the root if it has a single
+    // child. Returns the parent if it must be merged next, 0 otherwise.
+    PID mergeNode(PID target, std::span<uint8_t> key);
+
+    // Build the tree from records in strictly increasing key order, next returns false at the end. Nodes are filled
+    // to BULK_FILL percent, leaves get the dense or hash layout where inserts would use it. Falls back to inserts if
+    // the tree is not empty. Must not run concurrently with other operations on the tree, the records are not logged.
+    void bulkLoad(const std::function<bool(std::span<uint8_t> &key, std::span<uint8_t> &payload)> &next);
+
+    // Like bulkLoad for count records, record(i) returns the i-th and may be called concurrently. The records are split
+    // into threadCount key ranges whose leaves are built concurrently by the calling thread and threads with the worker
+    // ids from firstWorkerId on, no other thread may use these ids. The inner levels are built on top afterwards.
+    void bulkLoadParallel(uint64_t count, unsigned threadCount, unsigned firstWorkerId,
+                          const std::function<void(uint64_t i, std::span<uint8_t> &key,
+                                                   std::span<uint8_t> &payload)> &record);
+
     void nodeCount(std::array<uint32_t, TAG_END + 2> &counts);
 };
 
@@ -81,6 +81,7 @@ void BTreeNodeHeader::init(bool isLeaf, RangeOpCounter roc) {
     dataOffset = (isLeaf ? pageSizeLeaf : pageSizeInner);
     lowerFence = {};
     upperFence = {};
+    prefixLength = 0;
     upper = 0;
 }
 
@@ -127,6 +128,73 @@ bool BTreeNode::insert(std::span<uint8_t> key, std::span<uint8_t> payload) {
     return true;
 }
 
+void BTreeNode::removeSlot(unsigned slotId) {
+    spaceUsed -= slot[slotId].keyLen + slot[slotId].payloadLen;
+    memmove(slot + slotId, slot + slotId + 1, sizeof(Slot) * (count - slotId - 1));
+    count--;
+    makeHint();
+}
+
+bool BTreeNode::remove(std::span<uint8_t> key) {
+    bool found;
+    unsigned slotId = lowerBound(key, found);
+    if (!found)
+        return false;
+    removeSlot(slotId);
+    validate();
+    return true;
+}
+
+bool BTreeNode::is_underfull() {
+    unsigned size = isLeaf() ? pageSizeLeaf : pageSizeInner;
+    return size - freeSpaceAfterCompaction() < (isLeaf() ? underFullSizeLeaf : underFullSizeInner);
+}
+
+bool BTreeNode::mergeNodes(unsigned slotId, AnyNode *parent, BTreeNode *right) {
+    TmpBTreeNode tmp;
+    if (!buildMerged(right, tmp.node))
+        return false;
+    parent->basic()->removeSeparator(slotId, bm.toPID(this));
+    memcpy(reinterpret_cast<char *>(this), &tmp.node, isLeaf() ? pageSizeLeaf : pageSizeInner);
+    return true;
+}
+
+bool BTreeNode::buildMerged(BTreeNode *right, BTreeNode &merged) {
+    assert(isLeaf() == right->isLeaf());
+    merged.init(isLeaf(), rangeOpCounter);
+    merged.setFences(getLowerFence(), right->getUpperFence());
+    // keys lose the part of the prefix that is not common to both nodes
+    unsigned leftGrow = (prefixLength - merged.prefixLength) * count;
+    unsigned rightGrow = (right->prefixLength - merged.prefixLength) * right->count;
+    unsigned leftEntries = spaceUsed - lowerFence.length - upperFence.length;
+    unsigned rightEntries = right->spaceUsed - right->lowerFence.length - right->upperFence.length;
+    // inner nodes pull the separator down from the parent, it is the upper fence of this node
+    unsigned separatorSpace = isInner() ? merged.spaceNeeded(upperFence.length, sizeof(PID)) : 0;
+    if ((count + right->count) * sizeof(Slot) + leftEntries + leftGrow + rightEntries + rightGrow + separatorSpace >
+        merged.freeSpace())
+        return false;
+    copyKeyValueRange(&merged, 0, 0, count);
+    if (isInner()) {
+        merged.storeKeyValue(merged.count, getUpperFence(), {reinterpret_cast<uint8_t *>(&upper), sizeof(PID)});
+        merged.count++;
+        merged.upper = right->upper;
+    }
+    right->copyKeyValueRange(&merged, merged.count, 0, right->count);
+    merged.makeHint();
+    merged.validate();
+    return true;
+}
+
+void BTreeNode::removeSeparator(unsigned slotId, PID child) {
+    assert(isInner() && slotId < count);
+    // the child right of the separator takes over its key range
+    if (slotId + 1 == count)
+        upper = child;
+    else
+        storeUnaligned<PID>(getPayload(slotId + 1).data(), child);
+    removeSlot(slotId);
+}
+
 unsigned BTreeNode::spaceNeeded(unsigned keyLength, unsigned payloadLength) {
     ASSUME(enablePrefix || prefixLength == 0);
     ASSUME(keyLength >=
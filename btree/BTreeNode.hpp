@@ -109,9 +109,18 @@ struct BTreeNode : public BTreeNodeHeader {
 
     void compactify();
 
-    // merge "this" into "right" via "tmp"
+    // Merge "right" into "this" via "tmp", slotId is the separator between the two in parent. Inner nodes take over
+    // the separator as the key of their upper child. Returns false if the entries do not fit into one node. On
+    // success right must be freed by the caller.
     bool mergeNodes(unsigned slotId, AnyNode *parent, BTreeNode *right);
 
+    // Build the merge of this and right in the page sized merged, neither node is modified. Returns false if the
+    // entries do not fit into one node.
+    bool buildMerged(BTreeNode *right, BTreeNode &merged);
+
+    // inner node: the children around the separator at slotId were merged into child, remove the separator
+    void removeSeparator(unsigned slotId, PID child);
+
     // store key/value pair at slotId
     void storeKeyValue(uint16_t slotId, std::span<uint8_t> key, std::span<uint8_t> payload);
 
@@ -23,6 +23,61 @@ void DataStructureWrapper::insert(std::span<uint8_t> key, std::span<uint8_t> pay
     return impl.insertImpl(key, payload);
 }
 
+void DataStructureWrapper::bulkLoad(const std::function<bool(std::span<uint8_t> &, std::span<uint8_t> &)> &next) {
+#ifdef CHECK_TREE_OPS
+    auto checkedNext = [&](std::span<uint8_t> &key, std::span<uint8_t> &payload) {
+        if (!next(key, payload))
+            return false;
+        std_map[toByteVector(key)] = toByteVector(payload);
+        return true;
+    };
+#else
+    auto &checkedNext = next;
+#endif
+#ifdef USE_STRUCTURE_BTREE
+    impl.bulkLoad(checkedNext);
+#else
+    std::span<uint8_t> key;
+    std::span<uint8_t> payload;
+    while (checkedNext(key, payload))
+        impl.insertImpl(key, payload);
+#endif
+}
+
+void DataStructureWrapper::bulkLoadParallel(uint64_t count, unsigned threadCount, unsigned firstWorkerId,
+                                            const std::function<void(uint64_t, std::span<uint8_t> &,
+                                                                     std::span<uint8_t> &)> &record) {
+#ifdef CHECK_TREE_OPS
+    for (uint64_t i = 0; i < count; i++) {
+        std::span<uint8_t> key;
+        std::span<uint8_t> payload;
+        record(i, key, payload);
+        std_map[toByteVector(key)] = toByteVector(payload);
+    }
+#endif
+#ifdef USE_STRUCTURE_BTREE
+    impl.bulkLoadParallel(count, threadCount, firstWorkerId, record);
+#else
+    for (uint64_t i = 0; i < count; i++) {
+        std::span<uint8_t> key;
+        std::span<uint8_t> payload;
+        record(i, key, payload);
+        impl.insertImpl(key, payload);
+    }
+#endif
+}
+
+bool DataStructureWrapper::remove(uint8_t *key, unsigned keyLength) {
+#ifdef CHECK_TREE_OPS
+    std_map.erase(toByteVector({key, keyLength}));
+#endif
+#if defined(USE_STRUCTURE_BTREE) || defined(USE_STRUCTURE_VMCACHE)
+    return impl.removeImpl({key, keyLength});
+#else
+    TODO_UNIMPL
+#endif
+}
+
 void DataStructureWrapper::lookup(std::span<uint8_t> key, std::function<void(std::span<uint8_t>)> callback) {
 #ifdef CHECK_TREE_OPS
     bool found = false;
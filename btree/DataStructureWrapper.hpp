@@ -49,6 +49,17 @@ struct DataStructureWrapper {
 
     bool remove(uint8_t *key, unsigned keyLength);
 
+    // Load records in strictly increasing key order, next returns false at the end. Structures without a bulk loader
+    // insert them one at a time.
+    void bulkLoad(const std::function<bool(std::span<uint8_t> &key, std::span<uint8_t> &payload)> &next);
+
+    // Load count records in strictly increasing key order, record(i) returns the i-th. The BTree builds threadCount key
+    // ranges concurrently using the worker ids from firstWorkerId on, see BTree::bulkLoadParallel, others insert them
+    // one at a time.
+    void bulkLoadParallel(uint64_t count, unsigned threadCount, unsigned firstWorkerId,
+                          const std::function<void(uint64_t i, std::span<uint8_t> &key,
+                                                   std::span<uint8_t> &payload)> &record);
+
     // keyOutBuffer must be at least maxKvSize.
     // may throw OLCRestartException.
     void range_lookup(std::span<uint8_t> key, uint8_t *keyOutBuffer,
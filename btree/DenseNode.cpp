@@ -96,17 +96,18 @@ void DenseNode::copyKeyValueRangeToBasic(BTreeNode *dst, unsigned srcStart, unsi
     unsigned npLen = computeNumericPartLen(fullKeyLen);
     unsigned outSlot = 0;
     for (unsigned i = srcStart; i < srcEnd; i++) {
-        if (!isSlotPresent(i)) {
+        if (tag() == Tag::Dense ? !isSlotPresent(i) : slots[i] == 0) {
             continue;
         }
         NumericPart numericPart = __builtin_bswap32(arrayStart + static_cast<NumericPart>(i));
         unsigned newKeyLength = fullKeyLen - dst->prefixLength;
-        unsigned space = newKeyLength + valLen;
+        unsigned payloadLen = tag() == Tag::Dense ? valLen : slotValLen(i);
+        unsigned space = newKeyLength + payloadLen;
         dst->dataOffset -= space;
         dst->spaceUsed += space;
         dst->slot[outSlot].offset = dst->dataOffset;
         dst->slot[outSlot].keyLen = fullKeyLen - dst->prefixLength;
-        dst->slot[outSlot].payloadLen = valLen;
+        dst->slot[outSlot].payloadLen = payloadLen;
         if (fullKeyLen - npLen > dst->prefixLength) {
             memcpy(dst->getKey(outSlot).data(), getPrefix().data() + dst->prefixLength,
                    fullKeyLen - npLen - dst->prefixLength);
@@ -527,9 +528,16 @@ void DenseNode::init2b(std::span<uint8_t> lowerFence,
 }
 
 bool DenseNode::is_underfull() {
-    unsigned totalEntrySize = (fullKeyLen - prefixLength + valLen + sizeof(BTreeNode::Slot)) * occupiedCount;
-    return sizeof(BTreeNodeHeader) + totalEntrySize + lowerFenceLen + upperFenceLen <
-           pageSizeLeaf - BTreeNode::underFullSizeLeaf;
+    return basicSize() < BTreeNode::underFullSizeLeaf;
+}
+
+unsigned DenseNode::basicSize() {
+    unsigned totalEntrySize;
+    if (tag() == Tag::Dense)
+        totalEntrySize = (fullKeyLen - prefixLength + valLen + sizeof(BTreeNode::Slot)) * occupiedCount;
+    else  // spaceUsed includes the 2 byte length of each value
+        totalEntrySize = (fullKeyLen - prefixLength + sizeof(BTreeNode::Slot) - 2) * occupiedCount + spaceUsed;
+    return sizeof(BTreeNodeHeader) + totalEntrySize + lowerFenceLen + upperFenceLen;
 }
 
 unsigned DenseNode::maskWordCount() {
@@ -609,12 +617,20 @@ unsigned DenseNode::computeSlotCount(unsigned valLen, unsigned fencesStart) {
 }
 
 bool DenseNode::remove(std::span<uint8_t> key) {
-    assert(tag() == Tag::Dense);  // dense2 remove is not implemented
     KeyError index = keyToIndex(key);
-    if (index < 0 || !isSlotPresent(index)) {
+    if (index < 0)
         return false;
+    if (tag() == Tag::Dense) {
+        if (!isSlotPresent(index))
+            return false;
+        unsetSlotPresent(index);
+    } else {
+        if (!slots[index])
+            return false;
+        // the value stays in the heap until the next compaction in requestSpaceFor
+        spaceUsed -= slotValLen(index) + 2;
+        slots[index] = 0;
     }
-    unsetSlotPresent(index);
     occupiedCount -= 1;
     return true;
 }
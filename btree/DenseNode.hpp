@@ -144,6 +144,9 @@ struct DenseNode : TagAndDirty {
 
     bool is_underfull();
 
+    // size of the node after convertToBasic, which requires it to be at most pageSizeLeaf
+    unsigned basicSize();
+
     BTreeNode *convertToBasic();
 
     bool range_lookup1(std::span<uint8_t> key,
@@ -99,6 +99,53 @@ bool HashNode::insert(std::span<uint8_t> key, std::span<uint8_t> payload) {
     return true;
 }
 
+bool HashNode::removeSlot(unsigned int slotId) {
+    spaceUsed -= slot[slotId].keyLen + slot[slotId].payloadLen;
+    std::span<uint8_t> h = hashes();
+    memmove(h.data() + slotId, h.data() + slotId + 1, count - slotId - 1);
+    memmove(slot + slotId, slot + slotId + 1, sizeof(HashSlot) * (count - slotId - 1));
+    count -= 1;
+    // the remaining slots keep their order
+    if (slotId < sortedCount)
+        sortedCount -= 1;
+    validate();
+    return true;
+}
+
+bool HashNode::remove(uint8_t *key, unsigned int keyLength) {
+    std::span<uint8_t> k{key, keyLength};
+    ASSUME(keyLength >= prefixLength);
+    int index = findIndex(k, compute_hash(k.subspan(prefixLength, keyLength - prefixLength)));
+    if (index < 0)
+        return false;
+    return removeSlot(index);
+}
+
+bool HashNode::is_underfull() {
+    return pageSizeLeaf - freeSpaceAfterCompaction() < BTreeNode::underFullSizeLeaf;
+}
+
+bool HashNode::mergeNodes(unsigned int slotId, AnyNode *parent, HashNode *right) {
+    HashNode tmp;
+    unsigned mergedCount = count + right->count;
+    tmp.init(getLowerFence(), right->getUpperFence(), mergedCount, rangeOpCounter);
+    unsigned leftGrow = (prefixLength - tmp.prefixLength) * count;
+    unsigned rightGrow = (right->prefixLength - tmp.prefixLength) * right->count;
+    unsigned leftEntries = spaceUsed - lowerFenceLen - upperFenceLen;
+    unsigned rightEntries = right->spaceUsed - right->lowerFenceLen - right->upperFenceLen;
+    if (mergedCount * sizeof(HashSlot) + leftEntries + leftGrow + rightEntries + rightGrow > tmp.freeSpace())
+        return false;
+    tmp.count = mergedCount;
+    copyKeyValueRange(&tmp, 0, 0, count);
+    right->copyKeyValueRange(&tmp, count, 0, right->count);
+    // all keys of this node are less than those of right
+    tmp.sortedCount = isSorted() ? count + right->sortedCount : sortedCount;
+    tmp.validate();
+    parent->basic()->removeSeparator(slotId, bm.toPID(this));
+    memcpy(this, &tmp, pageSizeLeaf);
+    return true;
+}
+
 unsigned int HashNode::freeSpace() {
     return dataOffset - (reinterpret_cast<uint8_t *>(slot + count) - ptr());
 }
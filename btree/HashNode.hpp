@@ -101,8 +101,11 @@ struct HashNode : public HashNodeHeader {
 
     bool remove(uint8_t *key, unsigned int keyLength);
 
+    // see BTreeNode::mergeNodes
     bool mergeNodes(unsigned int slotId, AnyNode *parent, HashNode *right);
 
+    bool is_underfull();
+
     void print();
 
     bool range_lookupImpl(std::span<uint8_t> key, uint8_t *keyOutBuffer,
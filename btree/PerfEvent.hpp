@@ -215,6 +215,21 @@ struct BTreeCppPerfEventBlock {
 
     void pushNodeCounts() {
         push("vmCacheAllocCount", std::to_string(bm.allocCount));
+        push("vmCachePinnedUsed", std::to_string(bm.pinnedUsed));
+        push("vmCachePinnedFallbacks", std::to_string(bm.pinnedFallbacks));
+        push("vmCacheTierPromotions", std::to_string(bm.promotions));
+        push("vmCacheTierDemotions", std::to_string(bm.demotions));
+        push("vmCacheFastReads", std::to_string(bm.fastReads));
+        push("vmCacheZTierHits", std::to_string(bm.compressedTier.hits));
+        push("vmCacheZTierDrops", std::to_string(bm.compressedTier.drops));
+        push("vmCacheSuspendedFaults", std::to_string(bm.suspendedFaults));
+        for (unsigned t = 0; t < bm.treeCount; t++) {
+            std::string prefix = "vmCacheTree" + std::to_string(t);
+            push(prefix + "Resident", std::to_string(bm.treeFrames[t].resident.loadExact()));
+            push(prefix + "Accesses", std::to_string(bm.treeFrames[t].accesses.loadExact()));
+            push(prefix + "Misses", std::to_string(bm.treeFrames[t].misses.loadExact()));
+            push(prefix + "Evictions", std::to_string(bm.treeFrames[t].evictions.loadExact()));
+        }
         if (getenv("SKIP_NODE_COUNT")) {
             return;
         }
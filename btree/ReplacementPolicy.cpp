@@ -0,0 +1,148 @@
+#include "ReplacementPolicy.hpp"
+#include "common.hpp"
+
+std::unique_ptr<ReplacementPolicy> ReplacementPolicy::create(u64 virtCount, u64 physCount, u64 physCountMax) {
+    const char *policyName = getenv("EVICT_POLICY") ? getenv("EVICT_POLICY") : "clock";
+    if (strcmp(policyName, "clock") == 0)
+        return std::make_unique<ClockPolicy>();
+    if (strcmp(policyName, "2q") == 0)
+        return std::make_unique<TwoQueuePolicy>(virtCount, physCount);
+    if (strcmp(policyName, "tinylfu") == 0)
+        return std::make_unique<TinyLfuPolicy>(virtCount, physCount, physCountMax);
+    std::cerr << "unknown EVICT_POLICY '" << policyName << "'" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+TwoQueuePolicy::TwoQueuePolicy(u64 virtCount, u64 physCount) : virtCount(virtCount), hotCount(0) {
+    hotPercent = envOr("EVICT_HOT_PERCENT", 75);
+    if (hotPercent >= 100) {
+        std::cerr << "EVICT_HOT_PERCENT must be less than 100" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    hotLimit = physCount * hotPercent / 100;
+    // zeroed by mmap, only the flags of resident pages are touched
+    pageFlags = (std::atomic<u8> *) allocHuge(virtCount * sizeof(std::atomic<u8>));
+}
+
+TwoQueuePolicy::~TwoQueuePolicy() {
+    munmap(pageFlags, virtCount * sizeof(std::atomic<u8>));
+}
+
+void TwoQueuePolicy::inserted(PID pid, bool /*faulted*/) {
+    if (pageFlags[pid].exchange(New, std::memory_order_relaxed) & Hot)
+        hotCount--;
+}
+
+void TwoQueuePolicy::removed(PID pid) {
+    if (pageFlags[pid].exchange(0, std::memory_order_relaxed) & Hot)
+        hotCount--;
+}
+
+void TwoQueuePolicy::referenced(PID pid) {
+    u8 flags = pageFlags[pid].load(std::memory_order_relaxed);
+    if (flags & New) {
+        pageFlags[pid].fetch_and(~New, std::memory_order_relaxed);
+        return;
+    }
+    if (!(flags & Hot) && admit(pid))
+        promote(pid);
+}
+
+bool TwoQueuePolicy::evictable(PID pid) {
+    if (!(pageFlags[pid].load(std::memory_order_relaxed) & Hot))
+        return true;
+    // Evictions take cold pages while there is room for hot ones. Once the hot set is full, demote the page, it stays
+    // marked and is evicted on the next rotation unless it is accessed.
+    if (hotCount.load(std::memory_order_relaxed) >= hotLimit &&
+        (pageFlags[pid].fetch_and(~Hot, std::memory_order_relaxed) & Hot))
+        hotCount--;
+    return false;
+}
+
+bool TwoQueuePolicy::touchedOnce(PID pid) {
+    if (pageFlags[pid].load(std::memory_order_relaxed) & Hot)
+        return false;
+    // the next access makes the page hot
+    pageFlags[pid].fetch_and(~New, std::memory_order_relaxed);
+    return true;
+}
+
+void TwoQueuePolicy::resized(u64 physCount) {
+    hotLimit = physCount * hotPercent / 100;
+}
+
+bool TwoQueuePolicy::promote(PID pid) {
+    if (hotCount.load(std::memory_order_relaxed) >= hotLimit)
+        return false;
+    if (pageFlags[pid].fetch_or(Hot, std::memory_order_relaxed) & Hot)
+        return false;
+    hotCount++;
+    return true;
+}
+
+FrequencySketch::FrequencySketch(u64 expectedCount) : additions(0) {
+    width = 1024;
+    while (width < expectedCount)
+        width *= 2;
+    sampleSize = 10 * width;
+    counters = (std::atomic<u8> *) allocHuge(depth * width * sizeof(std::atomic<u8>));
+}
+
+FrequencySketch::~FrequencySketch() {
+    munmap(counters, depth * width * sizeof(std::atomic<u8>));
+}
+
+void FrequencySketch::increment(PID pid) {
+    // lost updates under contention only make the estimate less precise
+    for (unsigned row = 0; row < depth; row++) {
+        std::atomic<u8> &c = counters[index(pid, row)];
+        u8 count = c.load(std::memory_order_relaxed);
+        if (count < maxCount)
+            c.store(count + 1, std::memory_order_relaxed);
+    }
+    if (additions.fetch_add(1, std::memory_order_relaxed) + 1 == sampleSize) {
+        age();
+        additions.fetch_sub(sampleSize, std::memory_order_relaxed);
+    }
+}
+
+u8 FrequencySketch::estimate(PID pid) {
+    u8 count = maxCount;
+    for (unsigned row = 0; row < depth; row++)
+        count = std::min(count, counters[index(pid, row)].load(std::memory_order_relaxed));
+    return count;
+}
+
+void FrequencySketch::age() {
+    for (u64 i = 0; i < depth * width; i++)
+        counters[i].store(counters[i].load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+}
+
+TinyLfuPolicy::TinyLfuPolicy(u64 virtCount, u64 physCount, u64 physCountMax)
+        : TwoQueuePolicy(virtCount, physCount), sketch(physCountMax), faultFrequency(16) {}
+
+void TinyLfuPolicy::inserted(PID pid, bool faulted) {
+    TwoQueuePolicy::inserted(pid, faulted);
+    if (!faulted)
+        return;
+    sketch.increment(pid);
+    // exponential moving average with weight 1/16, racy updates are fine
+    u64 average = faultFrequency.load(std::memory_order_relaxed);
+    faultFrequency.store(average - average / 16 + sketch.estimate(pid), std::memory_order_relaxed);
+}
+
+void TinyLfuPolicy::referenced(PID pid) {
+    sketch.increment(pid);
+    u8 flags = pageFlags[pid].load(std::memory_order_relaxed);
+    // pages that were frequent before they were evicted skip the cold phase
+    if ((flags & New) && admit(pid)) {
+        pageFlags[pid].fetch_and(~New, std::memory_order_relaxed);
+        promote(pid);
+        return;
+    }
+    TwoQueuePolicy::referenced(pid);
+}
+
+bool TinyLfuPolicy::admit(PID pid) {
+    return sketch.estimate(pid) * 16ull > faultFrequency.load(std::memory_order_relaxed);
+}
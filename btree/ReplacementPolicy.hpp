@@ -0,0 +1,129 @@
+#ifndef BTREE24_REPLACEMENTPOLICY_HPP
+#define BTREE24_REPLACEMENTPOLICY_HPP
+
+#include <memory>
+#include "vmache.hpp"
+
+// Decides which resident pages BufferManager::evict may evict, selected with EVICT_POLICY.
+// All policies are driven by the clock sweep over the resident set: a page that is still marked when the hand
+// passes it again has not been accessed for a full rotation, any access clears the mark.
+// Callbacks may be called concurrently, also for the same page.
+struct ReplacementPolicy {
+    virtual ~ReplacementPolicy() {}
+
+    virtual const char *name() = 0;
+
+    // the page became resident and is locked exclusively, faulted is false for newly allocated pages
+    virtual void inserted(PID /*pid*/, bool /*faulted*/) {}
+
+    // the page is locked exclusively and is about to stop being resident
+    virtual void removed(PID /*pid*/) {}
+
+    // the hand passed an unmarked page, which is marked afterwards
+    virtual void referenced(PID /*pid*/) {}
+
+    // the hand passed a marked page, return false to keep it marked for another rotation
+    virtual bool evictable(PID /*pid*/) { return true; }
+
+    // A scan accessed the page and will not access it again. Return true to mark the page, so it is evicted on the
+    // next rotation unless someone else accesses it.
+    virtual bool touchedOnce(PID /*pid*/) { return false; }
+
+    // the number of frames changed, see BufferManager::resize
+    virtual void resized(u64 /*physCount*/) {}
+
+    // parse EVICT_POLICY, physCountMax is the largest number of frames the pool may be resized to
+    static std::unique_ptr<ReplacementPolicy> create(u64 virtCount, u64 physCount, u64 physCountMax);
+};
+
+// second chance, every page gets one rotation to be accessed again
+struct ClockPolicy : ReplacementPolicy {
+    const char *name() override { return "clock"; }
+};
+
+// Scan resistant variant of the clock in the style of 2Q and CLOCK-Pro. Pages start out cold, the accesses before
+// the first mark count as one (correlated references). Cold pages that are accessed again after being marked become
+// hot, up to EVICT_HOT_PERCENT of the frames. Only cold pages are evicted, once the hot set is full hot pages that
+// were not accessed for a rotation become cold. Pages touched once by scans stay cold and are marked immediately.
+struct TwoQueuePolicy : ReplacementPolicy {
+    static const u8 New = 1; // not marked since it became resident
+    static const u8 Hot = 2;
+
+    std::atomic<u8> *pageFlags;
+    u64 virtCount;
+    u64 hotPercent;
+    std::atomic<u64> hotLimit;
+    std::atomic<u64> hotCount;
+
+    TwoQueuePolicy(u64 virtCount, u64 physCount);
+
+    ~TwoQueuePolicy() override;
+
+    const char *name() override { return "2q"; }
+
+    void inserted(PID pid, bool faulted) override;
+
+    void removed(PID pid) override;
+
+    void referenced(PID pid) override;
+
+    bool evictable(PID pid) override;
+
+    bool touchedOnce(PID pid) override;
+
+    // a smaller hot set is reached by demoting hot pages as the hand passes them
+    void resized(u64 physCount) override;
+
+    // returns false if the hot set is full or the page was hot already
+    bool promote(PID pid);
+
+    // whether a re-referenced cold page may become hot
+    virtual bool admit(PID /*pid*/) { return true; }
+};
+
+// Count-min sketch of 4 bit access counters, halved every sampleSize increments so old accesses fade out.
+struct FrequencySketch {
+    static const unsigned depth = 4;
+    static const u8 maxCount = 15;
+
+    std::atomic<u8> *counters;
+    u64 width;
+    u64 sampleSize;
+    std::atomic<u64> additions;
+
+    explicit FrequencySketch(u64 expectedCount);
+
+    ~FrequencySketch();
+
+    u64 index(PID pid, unsigned row) {
+        u64 h = (pid + row) * 0x9e3779b97f4a7c15ull;
+        return row * width + ((h ^ (h >> 29)) & (width - 1));
+    }
+
+    void increment(PID pid);
+
+    u8 estimate(PID pid);
+
+    void age();
+};
+
+// TinyLFU admission on top of 2Q. Faults and referenced pages observed by the sweep are counted in a frequency
+// sketch that outlives residency. Cold pages only become hot if they are more frequent than the pages recently
+// faulted in, pages that were that frequent before being evicted become hot on their first reference.
+struct TinyLfuPolicy : TwoQueuePolicy {
+    FrequencySketch sketch;
+    // moving average of the frequency of faulted pages, in sixteenths
+    std::atomic<u64> faultFrequency;
+
+    TinyLfuPolicy(u64 virtCount, u64 physCount, u64 physCountMax);
+
+    const char *name() override { return "tinylfu"; }
+
+    void inserted(PID pid, bool faulted) override;
+
+    void referenced(PID pid) override;
+
+    bool admit(PID pid) override;
+};
+
+#endif //BTREE24_REPLACEMENTPOLICY_HPP
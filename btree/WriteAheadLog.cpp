@@ -0,0 +1,369 @@
+#include "WriteAheadLog.hpp"
+#include "common.hpp"
+#include <filesystem>
+
+WriteAheadLog wal;
+
+WriteAheadLog::WriteAheadLog() : enabled(false), replaying(false), mode(Mode::Async), fd(-1), floor(0), durable(0),
+                                 flushRequested(false), stop(false), structureReplayed(false), replayedTrees(0) {
+    if (!getenv("WAL_PATH"))
+        return;
+    path = getenv("WAL_PATH");
+    const char *modeName = getenv("WAL_MODE") ? getenv("WAL_MODE") : "async";
+    if (strcmp(modeName, "sync") == 0) {
+        mode = Mode::Sync;
+        period = std::chrono::milliseconds(1);
+    } else if (strcmp(modeName, "async") == 0) {
+        mode = Mode::Async;
+        period = std::chrono::milliseconds(1);
+    } else if (strcmp(modeName, "periodic") == 0) {
+        mode = Mode::Periodic;
+        period = std::chrono::milliseconds(envOr("WAL_PERIOD_MS", 100));
+    } else {
+        std::cerr << "unknown WAL_MODE '" << modeName << "'" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    // a fresh buffer manager starts with an empty log
+    bool reopen = envOr("REOPEN", 0);
+    std::vector<u64> segments = listSegments();
+    if (reopen) {
+        recover(segments);
+    } else {
+        for (u64 s: segments)
+            if (unlink(segmentPath(s).c_str()) != 0)
+                die("removing WAL segment");
+    }
+    segment = segments.empty() ? 0 : segments.back() + 1;
+    openSegment();
+    enabled = true;
+    flusher = std::thread([this] { flusherLoop(); });
+    std::cerr << "wal path:" << path << " segments:" << segments.size() << " mode:" << modeName
+              << " recovered:" << recoveredRecords.size() << std::endl;
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    if (!enabled)
+        return;
+    {
+        std::unique_lock lock(flushMutex);
+        stop = true;
+    }
+    flushWakeup.notify_all();
+    flusher.join();
+    close(fd);
+}
+
+u64 WriteAheadLog::nextLsn(ThreadBuffer &b, std::span<const PID> pages) {
+    // the pages are dirty already: if a checkpoint raised the floor after this read, it collects them
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    u64 counter = std::max(b.clock.load(std::memory_order_relaxed), floor.load());
+    for (PID pid: pages)
+        counter = std::max(counter, bm.pageLsn[pid].load(std::memory_order_relaxed) >> threadBits);
+    counter++;
+    b.clock.store(counter);
+    u64 lsn = (counter << threadBits) | workerThreadId;
+    for (PID pid: pages)
+        bm.pageLsn[pid].store(lsn, std::memory_order_relaxed);
+    return lsn;
+}
+
+void WriteAheadLog::append(RecordType type, u32 tree, PID pid, std::span<u8> key, std::span<u8> payload) {
+    assert(workerThreadId < maxWorkerThreads);
+    ThreadBuffer &b = buffers[workerThreadId];
+    std::unique_lock lock(b.mutex);
+    RecordHeader header{nextLsn(b, {&pid, 1}), tree, static_cast<u16>(key.size()), static_cast<u16>(payload.size()),
+                        type};
+    u8 *h = reinterpret_cast<u8 *>(&header);
+    b.data.insert(b.data.end(), h, h + sizeof(RecordHeader));
+    b.data.insert(b.data.end(), key.begin(), key.end());
+    b.data.insert(b.data.end(), payload.begin(), payload.end());
+    bool wake = mode != Mode::Periodic && b.data.size() >= wakeThreshold &&
+                b.data.size() - sizeof(RecordHeader) - key.size() - payload.size() < wakeThreshold;
+    lock.unlock();
+    if (wake)
+        flushWakeup.notify_one();
+}
+
+void WriteAheadLog::appendStructure(u32 tree, const std::vector<PID> &pages, const std::vector<PID> &freed) {
+    assert(workerThreadId < maxWorkerThreads);
+    ThreadBuffer &b = buffers[workerThreadId];
+    std::vector<PID> pids = pages;
+    pids.insert(pids.end(), freed.begin(), freed.end());
+    std::unique_lock lock(b.mutex);
+    RecordHeader header{nextLsn(b, pids), tree, static_cast<u16>(pages.size()), static_cast<u16>(freed.size()),
+                        Structure};
+    u8 *h = reinterpret_cast<u8 *>(&header);
+    u64 before = b.data.size();
+    b.data.insert(b.data.end(), h, h + sizeof(RecordHeader));
+    u8 *p = reinterpret_cast<u8 *>(pids.data());
+    b.data.insert(b.data.end(), p, p + pids.size() * sizeof(PID));
+    for (PID pid: pages) {
+        u8 *image = reinterpret_cast<u8 *>(bm.virtMem + pid);
+        b.data.insert(b.data.end(), image, image + pageSize);
+    }
+    bool wake = mode != Mode::Periodic && b.data.size() >= wakeThreshold && before < wakeThreshold;
+    lock.unlock();
+    if (wake)
+        flushWakeup.notify_one();
+}
+
+WriteAheadLog::StructureScope::StructureScope(u32 tree, std::initializer_list<PID> pages)
+        : pages(pages), tree(tree), active(wal.enabled && !structureChange), cancelled(false) {
+    if (active)
+        structureChange = &change;
+}
+
+WriteAheadLog::StructureScope::~StructureScope() {
+    if (!active)
+        return;
+    structureChange = nullptr;
+    auto contains = [](const std::vector<PID> &pids, PID pid) {
+        return std::find(pids.begin(), pids.end(), pid) != pids.end();
+    };
+    // freed pages need no image
+    std::vector<PID> images;
+    for (auto &list: {pages, change.allocated})
+        for (PID pid: list)
+            if (!contains(change.freed, pid) && !contains(images, pid))
+                images.push_back(pid);
+    if (!cancelled || !change.allocated.empty() || !change.freed.empty())
+        wal.appendStructure(tree, images, change.freed);
+    for (PID pid: change.released)
+        bm.unfixX(pid);
+    // the page lsns of freed pids are set, whoever allocates them next logs with a larger lsn
+    for (PID pid: change.freed)
+        bm.releasePid(pid);
+}
+
+void WriteAheadLog::commit() {
+    if (mode != Mode::Sync)
+        return;
+    waitDurable(buffers[workerThreadId].clock.load() << threadBits);
+}
+
+void WriteAheadLog::requestFlush() {
+    if (!enabled)
+        return;
+    std::unique_lock lock(flushMutex);
+    flushRequested = true;
+    flushWakeup.notify_one();
+}
+
+void WriteAheadLog::waitDurable(u64 lsn) {
+    if (!enabled || isDurable(lsn))
+        return;
+    std::unique_lock lock(flushMutex);
+    flushRequested = true;
+    flushWakeup.notify_one();
+    durableWakeup.wait(lock, [&] { return isDurable(lsn); });
+}
+
+u64 WriteAheadLog::beginCheckpoint() {
+    u64 max = floor.load();
+    for (ThreadBuffer &b: buffers)
+        max = std::max(max, b.clock.load());
+    floor.store(max);
+    // orders the store before the caller reads dirty flags, pairs with the fence in nextLsn
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    u64 checkpointLsn = (max + 1) << threadBits;
+    // the pages do not contain the records of trees that were not replayed yet
+    if (bm.reopened && replayedTrees < bm.superblock.treeCount)
+        checkpointLsn = std::min<u64>(checkpointLsn, bm.superblock.checkpointLsn);
+    return checkpointLsn;
+}
+
+std::string WriteAheadLog::segmentPath(u64 number) {
+    return path + "." + std::to_string(number);
+}
+
+std::vector<u64> WriteAheadLog::listSegments() {
+    std::filesystem::path file(path);
+    std::filesystem::path directory = file.has_parent_path() ? file.parent_path() : ".";
+    std::string prefix = file.filename().string() + ".";
+    std::vector<u64> segments;
+    for (auto &entry: std::filesystem::directory_iterator(directory)) {
+        std::string name = entry.path().filename().string();
+        if (name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0 &&
+            name.find_first_not_of("0123456789", prefix.size()) == std::string::npos)
+            segments.push_back(std::stoull(name.substr(prefix.size())));
+    }
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+void WriteAheadLog::openSegment() {
+    fd = open(segmentPath(segment).c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        std::cerr << "cannot create WAL segment '" << segmentPath(segment) << "'" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    segmentMaxCounter = 0;
+    // records in the segment are only durable once its directory entry is
+    syncDirectory();
+}
+
+void WriteAheadLog::syncDirectory() {
+    std::filesystem::path file(path);
+    std::string directory = file.has_parent_path() ? file.parent_path().string() : ".";
+    int dirFd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dirFd == -1 || fsync(dirFd) != 0)
+        die("syncing WAL directory");
+    close(dirFd);
+}
+
+void WriteAheadLog::truncate(u64 checkpointLsn) {
+    if (!enabled)
+        return;
+    std::vector<u64> dropped;
+    {
+        std::unique_lock lock(fileMutex);
+        // later records go to a new segment, so a later checkpoint can drop the current one
+        if (segmentMaxCounter) {
+            close(fd);
+            closedSegments.emplace_back(segment, segmentMaxCounter);
+            segment++;
+            openSegment();
+        }
+        std::erase_if(closedSegments, [&](std::pair<u64, u64> &closed) {
+            if ((closed.second + 1) << threadBits > checkpointLsn)
+                return false;
+            dropped.push_back(closed.first);
+            return true;
+        });
+    }
+    for (u64 s: dropped)
+        if (unlink(segmentPath(s).c_str()) != 0)
+            die("removing WAL segment");
+    if (!dropped.empty())
+        syncDirectory();
+}
+
+void WriteAheadLog::flusherLoop() {
+    std::vector<u8> out;
+    std::unique_lock lock(flushMutex);
+    while (true) {
+        if (!flushRequested && !stop)
+            flushWakeup.wait_for(lock, period);
+        bool exiting = stop;
+        flushRequested = false;
+        lock.unlock();
+        u64 flushed = flush(out);
+        lock.lock();
+        durable.store(flushed);
+        durableWakeup.notify_all();
+        if (exiting)
+            return;
+    }
+}
+
+u64 WriteAheadLog::flush(std::vector<u8> &out) {
+    out.clear();
+    // A thread hands out counters larger than its clock, which is raised to max while its buffer is drained. So every
+    // record with a counter up to max was drained now or before.
+    u64 max = 0;
+    for (ThreadBuffer &b: buffers)
+        max = std::max(max, b.clock.load());
+    // the drained records have counters up to the largest clock
+    u64 drainedMax = max;
+    for (ThreadBuffer &b: buffers) {
+        std::unique_lock lock(b.mutex);
+        out.insert(out.end(), b.data.begin(), b.data.end());
+        b.data.clear();
+        if (b.clock.load(std::memory_order_relaxed) < max)
+            b.clock.store(max);
+        drainedMax = std::max(drainedMax, b.clock.load(std::memory_order_relaxed));
+    }
+    if (out.empty())
+        return max;
+    std::unique_lock lock(fileMutex);
+    segmentMaxCounter = std::max(segmentMaxCounter, drainedMax);
+    for (u64 written = 0; written < out.size();) {
+        ssize_t ret = write(fd, out.data() + written, out.size() - written);
+        if (ret < 0)
+            die("writing WAL");
+        written += ret;
+    }
+    if (fdatasync(fd) != 0)
+        die("syncing WAL");
+    return max;
+}
+
+void WriteAheadLog::recover(const std::vector<u64> &segments) {
+    for (u64 s: segments) {
+        int segmentFd = open(segmentPath(s).c_str(), O_RDWR);
+        if (segmentFd == -1)
+            die("opening WAL segment");
+        off_t size = lseek(segmentFd, 0, SEEK_END);
+        if (size < 0)
+            die("lseek");
+        u64 begin = recovered.size();
+        recovered.resize(begin + size);
+        for (u64 offset = 0; offset < u64(size);) {
+            ssize_t ret = pread(segmentFd, recovered.data() + begin + offset, size - offset, offset);
+            if (ret <= 0)
+                die("reading WAL");
+            offset += ret;
+        }
+        u64 offset = begin;
+        u64 maxCounter = 0;
+        while (offset + sizeof(RecordHeader) <= recovered.size()) {
+            RecordHeader header = loadUnaligned<RecordHeader>(recovered.data() + offset);
+            if (header.lsn == 0 || header.type < Insert || header.type > Structure)
+                break;
+            u64 end = offset + recordSize(header);
+            if (end > recovered.size())
+                break;
+            recoveredRecords.emplace_back(u64(header.lsn), offset);
+            maxCounter = std::max<u64>(maxCounter, header.lsn >> threadBits);
+            offset = end;
+        }
+        // a crash may leave a partially written record at the end
+        if (offset < recovered.size() && ftruncate(segmentFd, offset - begin) != 0)
+            die("truncating WAL");
+        recovered.resize(offset);
+        close(segmentFd);
+        floor = std::max<u64>(floor, maxCounter);
+        closedSegments.emplace_back(s, maxCounter);
+    }
+    std::sort(recoveredRecords.begin(), recoveredRecords.end());
+}
+
+void WriteAheadLog::replay(u32 tree, u64 fromLsn,
+                           const std::function<void(RecordType, std::span<u8>, std::span<u8>)> &apply) {
+    // lsns must keep increasing even if the log was lost
+    floor = std::max<u64>(floor, fromLsn >> threadBits);
+    auto first = std::lower_bound(recoveredRecords.begin(), recoveredRecords.end(), std::pair<u64, u64>{fromLsn, 0});
+    if (!structureReplayed) {
+        structureReplayed = true;
+        bm.beginRedo();
+        for (auto it = first; it != recoveredRecords.end(); ++it) {
+            u8 *record = recovered.data() + it->second;
+            RecordHeader header = loadUnaligned<RecordHeader>(record);
+            if (header.type != Structure)
+                continue;
+            u8 *pids = record + sizeof(RecordHeader);
+            u8 *images = pids + (header.keyLen + header.payloadLen) * sizeof(PID);
+            for (unsigned i = 0; i < header.keyLen; i++) {
+                PID pid = loadUnaligned<PID>(pids + i * sizeof(PID));
+                Page *page = bm.redoPage(pid);
+                memcpy((void *) page, images + i * pageSize, pageSize);
+                page->tagAndDirty.set_dirty(true);
+                bm.unfixX(pid);
+            }
+            for (unsigned i = header.keyLen; i < header.keyLen + header.payloadLen; i++)
+                bm.redoFree(loadUnaligned<PID>(pids + i * sizeof(PID)));
+        }
+        bm.endRedo();
+    }
+    replaying = true;
+    for (auto it = first; it != recoveredRecords.end(); ++it) {
+        u8 *record = recovered.data() + it->second;
+        RecordHeader header = loadUnaligned<RecordHeader>(record);
+        if (header.tree != tree || header.type == Structure)
+            continue;
+        u8 *key = record + sizeof(RecordHeader);
+        apply(header.type, {key, header.keyLen}, {key + header.keyLen, header.payloadLen});
+    }
+    replaying = false;
+    replayedTrees++;
+}
@@ -0,0 +1,195 @@
+#ifndef BTREE24_WRITEAHEADLOG_HPP
+#define BTREE24_WRITEAHEADLOG_HPP
+
+#include <condition_variable>
+#include <functional>
+#include <initializer_list>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+#include "vmache.hpp"
+
+// Redo log of tree modifications, enabled by setting WAL_PATH. It is written to the segments WAL_PATH.<number>.
+// Key modifications are logged logically, appended to per-thread buffers while the modified leaf is locked
+// exclusively. Structure modifications (splits, merges, new roots) are logged physically as the images of all pages
+// they changed, taken before any of them is unlocked, see StructureScope. A single flusher thread writes all buffers
+// and syncs the file (group commit).
+// WAL_MODE selects durability:
+//  sync:     a modification returns once its record is durable
+//  async:    the flusher runs continuously, modifications do not wait
+//  periodic: the flusher runs every WAL_PERIOD_MS milliseconds, modifications do not wait
+//
+// Lsns are Lamport timestamps: a counter in the high bits and the worker thread id in the low bits. A thread's counter
+// exceeds its previous one and that of the last record of every page the record covers (BufferManager::pageLsn), so
+// records of the same page are ordered without a shared counter. Eviction and checkpoints only write a page once its
+// lsn is durable. Checkpoints are fuzzy, records from the checkpoint lsn in the superblock on describe everything that
+// happened during and after it. Once a checkpoint is complete, later records go to a new segment and the segments
+// holding only older records are removed.
+//
+// On REOPEN, the page images of all structure records are applied in lsn order first, which turns the checkpoint
+// into a valid tree again, then the key records of each tree in lsn order. Key records only describe the final effect
+// on one key, so replaying records that are already reflected in the image is harmless. Structure modifications
+// caused by the replay are logged, so a crash before the next checkpoint is recovered the same way.
+struct WriteAheadLog {
+    enum class Mode { Sync, Async, Periodic };
+
+    enum RecordType : u8 { Insert = 1, Remove = 2, Structure = 3 };
+
+    // Key records are followed by the key and the payload. Structure records use keyLen for the number of pages and
+    // payloadLen for the number of freed pids, followed by the pids of the pages, the freed pids and the page images.
+    struct RecordHeader {
+        u64 lsn; // lsns start at 1, zero marks the end of the log
+        u32 tree;
+        u16 keyLen;
+        u16 payloadLen;
+        RecordType type;
+    } __attribute__((packed));
+
+    // low bits of an lsn holding the worker thread id
+    static const unsigned threadBits = 9;
+    static_assert(maxWorkerThreads <= (1 << threadBits));
+
+    // wake the flusher once a thread buffer exceeds this size
+    static const u64 wakeThreshold = 64 * 1024;
+
+    // records of one worker thread, drained by the flusher
+    struct alignas(64) ThreadBuffer {
+        std::mutex mutex;
+        std::vector<u8> data;
+        // counter of the last lsn this thread handed out, only written under mutex
+        std::atomic<u64> clock{0};
+    };
+
+    // Collects the pages of one structure modification and logs them as one record when it ends, which must happen
+    // while all pages passed to it are still locked exclusively. Pages allocated or freed while it is open are added
+    // by the buffer manager. Nested scopes belong to the outermost one. Opened before the first page is modified.
+    struct StructureScope {
+        StructureChange change;
+        std::vector<PID> pages;
+        u32 tree;
+        bool active;
+        bool cancelled;
+
+        StructureScope(u32 tree, std::initializer_list<PID> pages);
+
+        ~StructureScope();
+
+        // the modification did not happen and left the pages unchanged, nothing is logged unless pages were allocated
+        // or freed
+        void cancel() { cancelled = true; }
+    };
+
+    bool enabled;
+    // set while key records are replayed, they are not logged again
+    bool replaying;
+    Mode mode;
+    std::string path;
+    // the current segment, records are appended to it
+    u64 segment;
+    int fd;
+    // largest lsn counter written to the current segment
+    u64 segmentMaxCounter;
+    // number and largest lsn counter of the older segments
+    std::vector<std::pair<u64, u64>> closedSegments;
+    // serializes writing the current segment with switching to the next one
+    std::mutex fileMutex;
+    std::chrono::microseconds period;
+    // new lsns have larger counters, raised by checkpoints
+    std::atomic<u64> floor;
+    // all records with counters up to this one are durable
+    std::atomic<u64> durable;
+    ThreadBuffer buffers[maxWorkerThreads];
+
+    std::thread flusher;
+    std::mutex flushMutex;
+    std::condition_variable flushWakeup;
+    std::condition_variable durableWakeup;
+    bool flushRequested;
+    bool stop;
+
+    // on reopen: recovered log contents and offsets of records sorted by lsn
+    std::vector<u8> recovered;
+    std::vector<std::pair<u64, u64>> recoveredRecords;
+    bool structureReplayed;
+    // checkpoints must not drop records of trees that were not replayed yet
+    unsigned replayedTrees;
+
+    WriteAheadLog();
+
+    ~WriteAheadLog();
+
+    static u64 recordSize(const RecordHeader &header) {
+        if (header.type == Structure)
+            return sizeof(RecordHeader) + (header.keyLen + header.payloadLen) * sizeof(PID) + header.keyLen * pageSize;
+        return sizeof(RecordHeader) + header.keyLen + header.payloadLen;
+    }
+
+    // next lsn of this thread for a record covering pages, stores it as their page lsn. Requires the buffer mutex.
+    u64 nextLsn(ThreadBuffer &b, std::span<const PID> pages);
+
+    // append a key record, the page modified by it must be locked exclusively
+    void append(RecordType type, u32 tree, PID pid, std::span<u8> key, std::span<u8> payload);
+
+    // append the images of the locked pages and the freed pids
+    void appendStructure(u32 tree, const std::vector<PID> &pages, const std::vector<PID> &freed);
+
+    // wait until all records of this thread are durable if the mode requires it
+    void commit();
+
+    // log a modification of the locked page, release the lock, and commit
+    template<class T>
+    void logAndRelease(GuardX<T> &guard, RecordType type, u32 tree, std::span<u8> key, std::span<u8> payload) {
+        if (!enabled || replaying) {
+            guard.release();
+            return;
+        }
+        append(type, tree, guard.pid(), key, payload);
+        guard.release();
+        commit();
+    }
+
+    bool isDurable(u64 lsn) { return (lsn >> threadBits) <= durable.load(); }
+
+    // wake the flusher without waiting for it
+    void requestFlush();
+
+    // wait until the record with this lsn is durable
+    void waitDurable(u64 lsn);
+
+    // Raise the floor for new lsns and return it as the checkpoint lsn. Records with smaller lsns belong to
+    // modifications whose pages were dirty before the call, a checkpoint collecting dirty pages afterwards writes them.
+    u64 beginCheckpoint();
+
+    // Switch to a new segment and remove the older ones holding only records with lsns below the lsn of a completed
+    // checkpoint.
+    void truncate(u64 checkpointLsn);
+
+    std::string segmentPath(u64 number);
+
+    // numbers of the existing segments in ascending order
+    std::vector<u64> listSegments();
+
+    // create the segment with the current number and make it the one written to
+    void openSegment();
+
+    // make created and removed segments durable
+    void syncDirectory();
+
+    // Apply the records of a tree starting at fromLsn in lsn order, key records are not logged while doing so. The
+    // first call applies the structure records of all trees. Must be called before any modification is logged, the
+    // calling thread needs a worker thread id.
+    void replay(u32 tree, u64 fromLsn, const std::function<void(RecordType, std::span<u8>, std::span<u8>)> &apply);
+
+    void flusherLoop();
+
+    // write and sync all buffered records, returns the counter up to which all records are durable
+    u64 flush(std::vector<u8> &out);
+
+    // read the existing segments, drop torn tails, and index their records
+    void recover(const std::vector<u64> &segments);
+};
+
+extern WriteAheadLog wal;
+
+#endif //BTREE24_WRITEAHEADLOG_HPP
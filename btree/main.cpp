@@ -1,12 +1,16 @@
 #include <algorithm>
 #include <csignal>
+#include <semaphore.h>
 #include <fstream>
 #include <random>
 #include <set>
 #include <string>
 #include <functional>
+#include <numeric>
+#include <optional>
 #include "PerfEvent.hpp"
 #include "common.hpp"
+#include "AsyncScheduler.hpp"
 #include <iostream>
 
 #include <zipfc.h>
@@ -52,6 +56,73 @@ static bool keySizeAcceptable(unsigned maxPayload, vector<string> &data) {
     return true;
 }
 
+// posted by the SIGUSR1 handler, sem_post is async signal safe
+static sem_t resizeRequested;
+
+// With PHYS_CONTROL set, SIGUSR1 resizes the buffer pool to the number of MB written to that file. The buffer manager
+// threads start before main and do not block the signal, so it is handed to the trigger thread by a semaphore
+// instead of sigwait.
+static void startResizeTrigger() {
+    const char *path = getenv("PHYS_CONTROL");
+    if (!path)
+        return;
+    sem_init(&resizeRequested, 0, 0);
+    signal(SIGUSR1, [](int) { sem_post(&resizeRequested); });
+    std::thread([path] {
+        while (true) {
+            if (sem_wait(&resizeRequested) != 0)
+                continue; // interrupted
+            std::ifstream file(path);
+            u64 mb;
+            if (!(file >> mb)) {
+                std::cerr << "cannot read a size from " << path << std::endl;
+                continue;
+            }
+            if (bm.resize(mb * 1024 * 1024))
+                std::cerr << "resized buffer pool to " << mb << " MB" << std::endl;
+        }
+    }).detach();
+}
+
+// with PIN_THREADS set, pin each worker to one cpu, distributing consecutive thread ids round robin over numa nodes
+static void pinWorkerThread(unsigned tid) {
+    static bool pin = envOr("PIN_THREADS", 0);
+    static std::vector<NumaNode> nodes = numaNodesWithCpus();
+    if (!pin || nodes.empty())
+        return;
+    NumaNode &node = nodes[tid % nodes.size()];
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(node.cpus[(tid / nodes.size()) % node.cpus.size()], &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        std::cerr << "cannot pin thread " << tid << std::endl;
+}
+
+// Executes the operations of a worker thread. With CORO they are interleaved by an AsyncScheduler and may complete
+// after run returns, operations must capture their arguments by value and may run multiple times.
+struct OpRunner {
+    std::optional<AsyncScheduler> scheduler;
+
+    OpRunner() {
+        if (unsigned width = AsyncScheduler::configuredWidth())
+            scheduler.emplace(width);
+    }
+
+    template<class Fn>
+    void run(Fn op) {
+        if (scheduler)
+            scheduler->submit(std::move(op));
+        else
+            op();
+    }
+
+    // wait for all operations, before counting them
+    void drain() {
+        if (scheduler)
+            scheduler->drain();
+    }
+};
+
 static unsigned rangeStart(uint64_t start, uint64_t end, uint64_t nthread, uint64_t tid) {
     if (tid == nthread)
         return end;
@@ -59,6 +130,103 @@ static unsigned rangeStart(uint64_t start, uint64_t end, uint64_t nthread, uint6
         return start + (end - start) * tid / nthread;
 }
 
+// with BULK_LOAD set, the records inserted before the measured operations, or measured as insert0, are bulk loaded
+// by the worker threads instead, sorted first unless they are generated in key order
+static bool bulkLoadEnabled() {
+    static bool enabled = envOr("BULK_LOAD", 0);
+    return enabled;
+}
+
+// run fn(0) to fn(threadCount - 1) on their own threads
+static void parallelFor(unsigned threadCount, const std::function<void(unsigned)> &fn) {
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < threadCount; i++)
+        threads.emplace_back(fn, i);
+    for (std::thread &thread: threads)
+        thread.join();
+}
+
+// indices of the distinct keys in [start, end) in key order. Each of threadCount threads sorts a chunk, then merges
+// the slices of all chunks between two splitter keys sampled from the sorted chunks into its part of the output.
+static std::vector<uint32_t> sortedKeyOrder(Key *data, uint64_t start, uint64_t end, unsigned threadCount) {
+    auto less = [&](uint32_t a, uint32_t b) { return span_compare(data[a].span(), data[b].span()) < 0; };
+    std::vector<uint32_t> order(end - start);
+    if (order.empty())
+        return order;
+    std::iota(order.begin(), order.end(), start);
+    std::vector<uint64_t> bounds(threadCount + 1);
+    for (unsigned i = 0; i <= threadCount; i++)
+        bounds[i] = rangeStart(0, order.size(), threadCount, i);
+    parallelFor(threadCount, [&](unsigned i) {
+        std::sort(order.begin() + bounds[i], order.begin() + bounds[i + 1], less);
+    });
+
+    // threadCount evenly spaced samples per chunk, every threadCount-th sorted sample starts a part
+    std::vector<uint32_t> samples;
+    for (unsigned c = 0; c < threadCount; c++)
+        for (unsigned s = 0; s < threadCount && bounds[c] < bounds[c + 1]; s++)
+            samples.push_back(order[bounds[c] + (bounds[c + 1] - bounds[c]) * s / threadCount]);
+    std::sort(samples.begin(), samples.end(), less);
+    // cuts[i * threadCount + c] is where part i starts in chunk c, equal keys end up in the same part
+    std::vector<uint64_t> cuts((threadCount + 1) * threadCount);
+    parallelFor(threadCount, [&](unsigned c) {
+        cuts[c] = bounds[c];
+        cuts[threadCount * threadCount + c] = bounds[c + 1];
+        for (unsigned i = 1; i < threadCount; i++)
+            cuts[i * threadCount + c] = std::lower_bound(order.begin() + bounds[c], order.begin() + bounds[c + 1],
+                                                         samples[i * samples.size() / threadCount], less) -
+                                        order.begin();
+    });
+    for (unsigned i = 0; i < threadCount; i++) {
+        bounds[i + 1] = bounds[i];
+        for (unsigned c = 0; c < threadCount; c++)
+            bounds[i + 1] += cuts[(i + 1) * threadCount + c] - cuts[i * threadCount + c];
+    }
+    std::vector<uint32_t> merged(order.size());
+    parallelFor(threadCount, [&](unsigned i) {
+        std::vector<uint64_t> runs{bounds[i]};
+        for (unsigned c = 0; c < threadCount; c++) {
+            auto out = std::copy(order.begin() + cuts[i * threadCount + c],
+                                 order.begin() + cuts[(i + 1) * threadCount + c], merged.begin() + runs.back());
+            runs.push_back(out - merged.begin());
+        }
+        for (unsigned width = 1; width < threadCount; width *= 2)
+            for (unsigned first = 0; first + width < threadCount; first += 2 * width)
+                std::inplace_merge(merged.begin() + runs[first], merged.begin() + runs[first + width],
+                                   merged.begin() + runs[std::min(first + 2 * width, threadCount)], less);
+    });
+    order.swap(merged);
+
+    // drop duplicates, each thread compacts its range to the offset of the distinct keys before it
+    auto distinct = [&](uint64_t i) { return i == 0 || less(order[i - 1], order[i]); };
+    std::vector<uint64_t> offsets(threadCount + 1);
+    parallelFor(threadCount, [&](unsigned i) {
+        for (uint64_t j = bounds[i]; j < bounds[i + 1]; j++)
+            offsets[i + 1] += distinct(j);
+    });
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    std::vector<uint32_t> result(offsets[threadCount]);
+    parallelFor(threadCount, [&](unsigned i) {
+        uint64_t out = offsets[i];
+        for (uint64_t j = bounds[i]; j < bounds[i + 1]; j++)
+            if (distinct(j))
+                result[out++] = order[j];
+    });
+    return result;
+}
+
+// Called by one worker thread while the others wait. The workers use the ids up to threadCount, the bulk load
+// threads the ones after it.
+static void bulkLoad(DataStructureWrapper &t, Key *data, uint64_t start, uint64_t end, std::span<uint8_t> payload,
+                     unsigned threadCount) {
+    std::vector<uint32_t> order = sortedKeyOrder(data, start, end, threadCount);
+    t.bulkLoadParallel(order.size(), threadCount, threadCount + 1,
+                       [&](uint64_t i, std::span<uint8_t> &key, std::span<uint8_t> &value) {
+                           key = data[order[i]].span();
+                           value = payload;
+                       });
+}
+
 static void runMulti(BTreeCppPerfEvent e,
                      Key *data,
                      unsigned keyCount,
@@ -78,23 +246,30 @@ static void runMulti(BTreeCppPerfEvent e,
     std::atomic_bool keepWorking = true;
     std::atomic<uint64_t> ops_performed = 0;
 
+    // opening the tree may replay the log
+    setVmcacheWorkerThreadId(threadCount);
     DataStructureWrapper t(isDataInt(e));
 
-    setVmcacheWorkerThreadId(threadCount);
     std::vector<std::thread> threads;
     std::barrier barrier{threadCount + 1};
     for (int i = 0; i < threadCount; ++i) {
         // Start a thread and execute threadFunction with the thread ID as argument
         threads.emplace_back([&](unsigned tid) {
             setVmcacheWorkerThreadId(tid);
+            pinWorkerThread(tid);
             uint8_t outBuffer[maxKvSize];
             unsigned threadIndexOffset = index_samples / threadCount * tid;
             unsigned local_ops_performed = 0;
-            if (preInsert) {
+            OpRunner runner;
+            if (preInsert && bulkLoadEnabled()) {
+                if (tid == 0)
+                    bulkLoad(t, data, 0, preInsertCount, payload, threadCount);
+            } else if (preInsert) {
                 for (uint64_t i = rangeStart(0, preInsertCount, threadCount, tid);
                      i < rangeStart(0, preInsertCount, threadCount, tid + 1); i++) {
-                    t.insert(data[i].span(), payload);
+                    runner.run([&, i] { t.insert(data[i].span(), payload); });
                 }
+                runner.drain();
             }
             barrier.arrive_and_wait();
             barrier.arrive_and_wait();
@@ -102,51 +277,63 @@ static void runMulti(BTreeCppPerfEvent e,
             if (preInsert) {
                 for (uint64_t i = rangeStart(preInsertCount, keyCount, threadCount, tid);
                      i < rangeStart(preInsertCount, keyCount, threadCount, tid + 1); i++) {
-                    t.insert(data[i].span(), payload);
+                    runner.run([&, i] { t.insert(data[i].span(), payload); });
                 }
+            } else if (bulkLoadEnabled()) {
+                if (tid == 0)
+                    bulkLoad(t, data, 0, keyCount, payload, threadCount);
             } else {
                 for (uint64_t i = rangeStart(0, keyCount, threadCount, tid);
                      i < rangeStart(0, keyCount, threadCount, tid + 1); i++) {
-                    t.insert(data[i].span(), payload);
+                    runner.run([&, i] { t.insert(data[i].span(), payload); });
                 }
             }
+            runner.drain();
             barrier.arrive_and_wait();
             barrier.arrive_and_wait();
             // ycsb-c
             while (keepWorking.load(std::memory_order::relaxed)) {
                 unsigned keyIndex = zipfIndices[(threadIndexOffset + local_ops_performed) % index_samples];
                 assert(keyIndex < keyCount);
-                if (!t.lookup(data[keyIndex].span())) {
-                    std::cout << "missing key " << keyIndex << std::endl;
-                    abort();
-                }
+                runner.run([&, keyIndex] {
+                    if (!t.lookup(data[keyIndex].span())) {
+                        std::cout << "missing key " << keyIndex << std::endl;
+                        abort();
+                    }
+                });
                 local_ops_performed += 1;
             }
+            runner.drain();
             ops_performed += local_ops_performed;
             barrier.arrive_and_wait();
             local_ops_performed = 0;
             std::minstd_rand local_rng(tid);
             std::uniform_int_distribution range_len_distribution(unsigned(1), maxScanLength);
             barrier.arrive_and_wait();
-            // ycsb-e
+            // ycsb-e, scans complete after later ones were submitted when CORO interleaves them
+            unsigned submitted = 0;
             while (keepWorking.load(std::memory_order::relaxed)) {
-                unsigned index = zipfIndices[(threadIndexOffset + local_ops_performed) % index_samples];
+                unsigned index = zipfIndices[(threadIndexOffset + submitted++) % index_samples];
                 assert(index < keyCount);
                 unsigned scanLength = range_len_distribution(local_rng);
-                while (keepWorking.load(std::memory_order::relaxed)) {
-                    unsigned scanCount = 0;
-                    try {
-                        t.range_lookup(data[index].span(), outBuffer, [&](unsigned keyLen, std::span<uint8_t> payload) {
-                            scanCount += 1;
-                            return scanCount < scanLength;
-                        });
-                        local_ops_performed += 1;
-                        break;
-                    } catch (OLCRestartException e) {
-                        continue;
+                runner.run([&, index, scanLength] {
+                    while (keepWorking.load(std::memory_order::relaxed)) {
+                        unsigned scanCount = 0;
+                        try {
+                            t.range_lookup(data[index].span(), outBuffer,
+                                           [&](unsigned keyLen, std::span<uint8_t> payload) {
+                                               scanCount += 1;
+                                               return scanCount < scanLength;
+                                           });
+                            local_ops_performed += 1;
+                            break;
+                        } catch (OLCRestartException e) {
+                            continue;
+                        }
                     }
-                }
+                });
             }
+            runner.drain();
             ops_performed += local_ops_performed;
             barrier.arrive_and_wait();
         }, i);
@@ -161,7 +348,7 @@ static void runMulti(BTreeCppPerfEvent e,
             // work
             barrier.arrive_and_wait();
         } else {
-            e.setParam("op", "insert0");
+            e.setParam("op", bulkLoadEnabled() ? "bulkload0" : "insert0");
             BTreeCppPerfEventBlock b(e, t, keyCount);
             barrier.arrive_and_wait();
             // work
@@ -208,8 +395,13 @@ static void runMultiLarge(BTreeCppPerfEvent e,
                           unsigned workDuration,
                           double zipfParameter,
                           unsigned maxScanLength,
-                          unsigned threadCount
+                          unsigned threadCount,
+                          bool sortedKeys
 ) {
+    if (bulkLoadEnabled() && !sortedKeys) {
+        std::cerr << "BULK_LOAD with LARGE requires the int key set, whose keys are sorted by index" << std::endl;
+        exit(EXIT_FAILURE);
+    }
     u64 scanDuration = envOr("SCAN_DURATION", workDuration);
     u64 writeSleep = envOr("WRITE_SLEEP", 0);
     constexpr uint64_t index_samples = 1ull << 31;
@@ -228,12 +420,15 @@ static void runMultiLarge(BTreeCppPerfEvent e,
         // Start a thread and execute threadFunction with the thread ID as argument
         threads.emplace_back([&](unsigned tid) {
             setVmcacheWorkerThreadId(tid);
+            pinWorkerThread(tid);
             auto local_zipf_rng = create_zipfc_rng(0, tid, "thread_rng");
             std::array<uint32_t, 4096> zipfIndices;
             unsigned nextZipfIndex = zipfIndices.size();
             uint8_t outBuffer[maxKvSize];
             uint8_t keyBuffer[maxKvSize];
             unsigned local_ops_performed = 0;
+            // operations run one at a time and regenerate their key in keyBuffer
+            OpRunner runner;
             auto getZipfIndex = [&]() {
                 if (nextZipfIndex == zipfIndices.size()) {
                     fill_zipf_single_thread(local_zipf_rng, zipfP, zipfIndices.data(), zipfIndices.size());
@@ -245,11 +440,22 @@ static void runMultiLarge(BTreeCppPerfEvent e,
             };
             barrier.arrive_and_wait();
             barrier.arrive_and_wait();
-            //insert
-            for (uint64_t i = rangeStart(0, keyCount, threadCount, tid);
-                 i < rangeStart(0, keyCount, threadCount, tid + 1); i++) {
-                Key key = data(i, keyBuffer);
-                t.insert(key.span(), payload);
+            //insert, a reopened tree already contains the keys
+            if (!bm.reopened && bulkLoadEnabled()) {
+                if (tid == 0)
+                    t.bulkLoadParallel(keyCount, threadCount, threadCount + 1,
+                                       [&](uint64_t i, std::span<uint8_t> &key, std::span<uint8_t> &value) {
+                                           // called by several threads
+                                           static thread_local uint8_t buffer[maxKvSize];
+                                           key = data(i, buffer).span();
+                                           value = payload;
+                                       });
+            } else if (!bm.reopened) {
+                for (uint64_t i = rangeStart(0, keyCount, threadCount, tid);
+                     i < rangeStart(0, keyCount, threadCount, tid + 1); i++) {
+                    runner.run([&, i] { t.insert(data(i, keyBuffer).span(), payload); });
+                }
+                runner.drain();
             }
             barrier.arrive_and_wait();
             barrier.arrive_and_wait();
@@ -257,12 +463,15 @@ static void runMultiLarge(BTreeCppPerfEvent e,
             while (keepWorking.load(std::memory_order::relaxed)) {
                 uint64_t keyIndex = getZipfIndex();
                 assert(keyIndex < keyCount);
-                if (!t.lookup(data(keyIndex, keyBuffer).span())) {
-                    std::cout << "missing key " << keyIndex << std::endl;
-                    abort();
-                }
+                runner.run([&, keyIndex] {
+                    if (!t.lookup(data(keyIndex, keyBuffer).span())) {
+                        std::cout << "missing key " << keyIndex << std::endl;
+                        abort();
+                    }
+                });
                 local_ops_performed += 1;
             }
+            runner.drain();
             ops_performed += local_ops_performed;
             barrier.arrive_and_wait();
             local_ops_performed = 0;
@@ -272,23 +481,26 @@ static void runMultiLarge(BTreeCppPerfEvent e,
             // ycsb-e
             while (keepWorking.load(std::memory_order::relaxed)) {
                 uint64_t index = getZipfIndex();
-                Key key = data(index, keyBuffer);
                 assert(index < keyCount);
                 unsigned scanLength = range_len_distribution(local_rng);
-                while (keepWorking.load(std::memory_order::relaxed)) {
-                    unsigned scanCount = 0;
-                    try {
-                        t.range_lookup(key.span(), outBuffer, [&](unsigned keyLen, std::span<uint8_t> payload) {
-                            scanCount += 1;
-                            return scanCount < scanLength;
-                        });
-                        local_ops_performed += 1;
-                        break;
-                    } catch (OLCRestartException e) {
-                        continue;
+                runner.run([&, index, scanLength] {
+                    Key key = data(index, keyBuffer);
+                    while (keepWorking.load(std::memory_order::relaxed)) {
+                        unsigned scanCount = 0;
+                        try {
+                            t.range_lookup(key.span(), outBuffer, [&](unsigned keyLen, std::span<uint8_t> payload) {
+                                scanCount += 1;
+                                return scanCount < scanLength;
+                            });
+                            local_ops_performed += 1;
+                            break;
+                        } catch (OLCRestartException e) {
+                            continue;
+                        }
                     }
-                }
+                });
             }
+            runner.drain();
             ops_performed += local_ops_performed;
             barrier.arrive_and_wait();
         }, i);
@@ -297,7 +509,7 @@ static void runMultiLarge(BTreeCppPerfEvent e,
         //pre insert
         barrier.arrive_and_wait();
         {
-            e.setParam("op", "insert0");
+            e.setParam("op", bulkLoadEnabled() ? "bulkload0" : "insert0");
             BTreeCppPerfEventBlock b(e, t, keyCount);
             barrier.arrive_and_wait();
             // work
@@ -367,6 +579,7 @@ static void runPartitionedInsert(BTreeCppPerfEvent e,
             nextKey.tid = tid;
             uint32_t local_ops_performed = 0;
             setVmcacheWorkerThreadId(tid);
+            pinWorkerThread(tid);
             barrier.arrive_and_wait();
             barrier.arrive_and_wait();
             //insert
@@ -410,9 +623,10 @@ static void runMixed(BTreeCppPerfEvent e,
                      unsigned threadCount,
                      unsigned insertShare,
                      unsigned lookupShare,
-                     unsigned rangeShare
+                     unsigned rangeShare,
+                     unsigned removeShare
 ) {
-    if (insertShare + lookupShare + rangeShare != 8) {
+    if (insertShare + lookupShare + rangeShare + removeShare != 8) {
         std::cerr << "workload mix does not add up to 8" << std::endl;
         abort();
     }
@@ -426,6 +640,7 @@ static void runMixed(BTreeCppPerfEvent e,
 
     const unsigned insertThreshold = insertShare * 256 / 8;
     const unsigned scanThreshold = (insertShare + rangeShare) * 256 / 8;
+    const unsigned removeThreshold = (insertShare + rangeShare + removeShare) * 256 / 8;
 
     DataStructureWrapper t(isDataInt(e));
 
@@ -437,13 +652,21 @@ static void runMixed(BTreeCppPerfEvent e,
         // Start a thread and execute threadFunction with the thread ID as argument
         threads.emplace_back([&](unsigned tid) {
             setVmcacheWorkerThreadId(tid);
+            pinWorkerThread(tid);
             uint8_t outBuffer[maxKvSize];
             unsigned threadIndexOffset = index_samples / threadCount * tid;
             unsigned local_ops_performed = 0;
+            OpRunner runner;
             t.start_batch();
-            for (uint64_t i = rangeStart(0, preInsertCount, threadCount, tid);
-                 i < rangeStart(0, preInsertCount, threadCount, tid + 1); i++) {
-                t.insert(data[i].span(), payload);
+            if (bulkLoadEnabled()) {
+                if (tid == 0)
+                    bulkLoad(t, data, 0, preInsertCount, payload, threadCount);
+            } else {
+                for (uint64_t i = rangeStart(0, preInsertCount, threadCount, tid);
+                     i < rangeStart(0, preInsertCount, threadCount, tid + 1); i++) {
+                    runner.run([&, i] { t.insert(data[i].span(), payload); });
+                }
+                runner.drain();
             }
             t.end_batch();
             std::minstd_rand local_rng(tid);
@@ -462,38 +685,45 @@ static void runMixed(BTreeCppPerfEvent e,
                 unsigned keyIndex = zipfIndices[(threadIndexOffset + local_ops_performed) % index_samples];
                 uint8_t op_type = ops[local_ops_performed % ops.size()];
                 if (op_type < insertThreshold) {
-                    t.insert(data[keyIndex].span(), payload);
+                    runner.run([&, keyIndex] { t.insert(data[keyIndex].span(), payload); });
                 } else if (op_type < scanThreshold) {
                     //scan
                     unsigned scanLength = range_len_distribution(local_rng);
-                    while (keepWorking.load(std::memory_order::relaxed)) {
-                        unsigned scanCount = 0;
-                        try {
-                            t.range_lookup(data[keyIndex].span(), outBuffer,
-                                           [&](unsigned keyLen, std::span<uint8_t> payload) {
-                                               scanCount += 1;
-                                               return scanCount < scanLength;
-                                           });
-                            break;
-                        } catch (OLCRestartException e) {
-                            continue;
+                    runner.run([&, keyIndex, scanLength] {
+                        while (keepWorking.load(std::memory_order::relaxed)) {
+                            unsigned scanCount = 0;
+                            try {
+                                t.range_lookup(data[keyIndex].span(), outBuffer,
+                                               [&](unsigned keyLen, std::span<uint8_t> payload) {
+                                                   scanCount += 1;
+                                                   return scanCount < scanLength;
+                                               });
+                                break;
+                            } catch (OLCRestartException e) {
+                                continue;
+                            }
                         }
-                    }
+                    });
+                } else if (op_type < removeThreshold) {
+                    runner.run([&, keyIndex] { t.remove(data[keyIndex].data, data[keyIndex].len); });
                 } else {
                     //lookup
-                    while (keepWorking.load(std::memory_order::relaxed)) {
-                        try {
-                            unsigned len = payloadSize;
-                            t.lookup(data[keyIndex].span(), [&](auto val) { len = val.size(); });
-                            if (len != payloadSize)
-                                abort();
-                            break;
-                        } catch (OLCRestartException e) {
-                            continue;
+                    runner.run([&, keyIndex] {
+                        while (keepWorking.load(std::memory_order::relaxed)) {
+                            try {
+                                unsigned len = payloadSize;
+                                t.lookup(data[keyIndex].span(), [&](auto val) { len = val.size(); });
+                                if (len != payloadSize)
+                                    abort();
+                                break;
+                            } catch (OLCRestartException e) {
+                                continue;
+                            }
                         }
-                    }
+                    });
                 }
             }
+            runner.drain();
             ops_performed += local_ops_performed - 1;
             t.end_batch();
             barrier.arrive_and_wait();
@@ -504,6 +734,8 @@ static void runMixed(BTreeCppPerfEvent e,
         {
             std::stringstream op_name;
             op_name << "mixed" << insertShare << lookupShare << rangeShare;
+            if (removeShare)
+                op_name << removeShare;
             e.setParam("op", op_name.str());
             BTreeCppPerfEventBlock b(e, t, keyCount - preInsertCount);
             barrier.arrive_and_wait();
@@ -695,6 +927,7 @@ void runLargeInsert(unsigned int threadCount, unsigned int duration) {
         // Start a thread and execute threadFunction with the thread ID as argument
         threads.emplace_back([&](unsigned tid) {
             setVmcacheWorkerThreadId(tid);
+            pinWorkerThread(tid);
             auto rng = create_zipfc_rng(0, tid, "thread_rng");
             std::array<uint64_t, 512> key_buffer;
             fill_u64_single_thread(rng, key_buffer.data(), 1);
@@ -742,6 +975,7 @@ int main(int argc, char *argv[]) {
     unsigned threadCount = envu64("THREADS");
     unsigned rand_seed = getenv("SEED") ? envu64("SEED") : time(NULL);
     ZIPFC_RNG = create_zipfc_rng(rand_seed, 0, "main");
+    startResizeTrigger();
 #ifdef CHECK_TREE_OPS
     std::cerr << "CHECK_TREE_OPS enabled, forcing single threaded" << std::endl;
     threadCount = 1;
@@ -831,7 +1065,8 @@ int main(int argc, char *argv[]) {
                 return Key{buffer, string_key.len + 1};
             }
         };
-        runMultiLarge(e, getKey, keyCount, payloadSize, duration, zipfParameter, maxScanLength, threadCount);
+        runMultiLarge(e, getKey, keyCount, payloadSize, duration, zipfParameter, maxScanLength, threadCount,
+                      data_id == 0);
         return 0;
     }
     data = zipfc_load_keys(ZIPFC_RNG, keySet.c_str(), keyCount, intDensity, partition_count);
@@ -844,7 +1079,11 @@ int main(int argc, char *argv[]) {
 
     if (ycsb_variant >= 6000 && ycsb_variant < 7000) {
         runMixed(e, data, keyCount, payloadSize, duration, zipfParameter, maxScanLength, threadCount,
-                 ycsb_variant / 100 % 10, ycsb_variant / 10 % 10, ycsb_variant % 10);
+                 ycsb_variant / 100 % 10, ycsb_variant / 10 % 10, ycsb_variant % 10, 0);
+    } else if (ycsb_variant >= 70000 && ycsb_variant < 80000) {
+        // 7wxyz: insert, lookup, range and remove shares
+        runMixed(e, data, keyCount, payloadSize, duration, zipfParameter, maxScanLength, threadCount,
+                 ycsb_variant / 1000 % 10, ycsb_variant / 100 % 10, ycsb_variant / 10 % 10, ycsb_variant % 10);
     } else
         switch (ycsb_variant) {
             case 401: {
@@ -867,7 +1106,7 @@ int main(int argc, char *argv[]) {
             }
             case 601: {
                 runMixed(e, data, keyCount, payloadSize, duration, zipfParameter, maxScanLength, threadCount, 1, 6,
-                         1);
+                         1, 0);
                 break;
             }
             case 602: {
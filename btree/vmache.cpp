@@ -1,8 +1,19 @@
 #include "vmache.hpp"
 #include "common.hpp"
+#include "ReplacementPolicy.hpp"
+#include "WriteAheadLog.hpp"
+
+#ifdef BTREE_LZ4
+#include <lz4.h>
+#endif
 
 static std::mutex AIO_ERROR_LOCK;
 __thread uint16_t workerThreadId = ~0;
+__thread u64 asyncReadsInFlight = 0;
+__thread uint16_t currentTree = 0;
+__thread bool suspendFaults = false;
+__thread u64 currentTreeAccesses = 0;
+__thread StructureChange *structureChange = nullptr;
 __thread int32_t tpcchistorycounter = 0;
 
 void *allocHuge(size_t size) {
@@ -11,18 +22,51 @@ void *allocHuge(size_t size) {
     return p;
 }
 
+// parse a list of tree:value pairs like "0:512,2:64"
+static void parseTreeList(const char *env, const std::function<void(unsigned, u64)> &fn) {
+    const char *p = getenv(env);
+    if (!p)
+        return;
+    while (*p) {
+        char *end;
+        unsigned tree = strtoul(p, &end, 10);
+        if (end == p || *end != ':' || tree >= Superblock::maxTrees) {
+            std::cerr << env << " must be a comma separated list of tree:value pairs" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        fn(tree, strtoull(end + 1, &end, 10));
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+// one resident set shard per hardware thread, up to the maximum
+static u64 defaultResidentShards() {
+    u64 shards = 1;
+    while (shards < std::thread::hardware_concurrency() && shards < ResidentPageSet::maxShards)
+        shards *= 2;
+    return shards;
+}
+
 BufferManager bm;
 
+// io interface used by sync, protected by syncMutex
+static const unsigned syncIoSlot = maxWorkerThreads + maxEvictionThreads;
+
 BufferManager::BufferManager() : virtSize(envOr("VIRTGB", 16) * gb), physSize(envOr("PHYSGB", 4) * gb),
                                  virtCount(virtSize / pageSize), physCount(physSize / pageSize),
-                                 residentSet(physCount) {
+                                 physCountMax(std::max<u64>(envOr("PHYSGB_MAX", 0) * gb / pageSize, physCount)),
+                                 foregroundCount(physCount.load()),
+                                 residentSet(physCountMax, envOr("RESIDENT_SHARDS", defaultResidentShards())),
+                                 policy(ReplacementPolicy::create(virtCount, physCount, physCountMax)) {
     assert(virtSize >= physSize);
-    const char *path = getenv("BLOCK") ? getenv("BLOCK") : "/tmp/bm";
-    blockfd = open(path, O_RDWR | O_DIRECT, S_IRWXU);
-    if (blockfd == -1) {
-        std::cerr << "cannot open BLOCK device '" << path << "'" << std::endl;
+    if (physCountMax > virtCount) {
+        std::cerr << "PHYSGB_MAX exceeds VIRTGB" << std::endl;
         exit(EXIT_FAILURE);
     }
+    PageState::parking = envOr("LOCK_PARK", 0);
+    const char *path = getenv("BLOCK") ? getenv("BLOCK") : "/tmp/bm";
+    store.open(path, virtCount);
+    compressedTier.open(virtCount, residentSet.shardCount);
     u64 virtAllocSize = virtSize + (1
             << 17); // we allocate 128KB (= max len + max offset) extra to prevent segfaults during optimistic reads
 
@@ -34,64 +78,813 @@ BufferManager::BufferManager() : virtSize(envOr("VIRTGB", 16) * gb), physSize(en
         madvise(virtMem, virtAllocSize, MADV_NOHUGEPAGE);
     }
 
+    if (virtMem == MAP_FAILED)
+        die("mmap failed");
     pageState = (PageState *) allocHuge(virtCount * sizeof(PageState));
+    // zeroed by mmap, pages start out without a tree
+    pageOwner = (std::atomic<u8> *) allocHuge(virtCount * sizeof(std::atomic<u8>));
+    pageChances = (std::atomic<u8> *) allocHuge(virtCount * sizeof(std::atomic<u8>));
+    pageLsn = (std::atomic<u64> *) allocHuge(virtCount * sizeof(std::atomic<u64>));
+    parseTreeList("TREE_QUOTA_MB", [&](unsigned tree, u64 mb) { setTreeQuota(tree, mb * BufferManager::mb); });
+    parseTreeList("TREE_PRIORITY", [&](unsigned tree, u64 priority) {
+        setTreePriority(tree, std::min<u64>(priority, std::numeric_limits<u8>::max()));
+    });
+
+    // Frames are allocated on the node of the thread that faults or allocates them. Page states are accessed by
+    // all threads regardless of where the page resides, so they are interleaved. Resident set shards are spread
+    // round robin over the nodes.
+    std::vector<unsigned> nodeIds;
+    if (envOr("NUMA", 1))
+        for (auto &node: numaNodesWithCpus())
+            nodeIds.push_back(node.id);
+    numaNodeCount = 1;
+    if (nodeIds.size() > 1) {
+        if (numaBind(virtMem, virtAllocSize, MPOL_LOCAL, {}, false) &&
+            numaBind(pageState, virtCount * sizeof(PageState), MPOL_INTERLEAVE, nodeIds, false)) {
+            residentSet.placeShards(nodeIds);
+            numaNodeCount = nodeIds.size();
+        } else {
+            std::cerr << "mbind failed, numa placement disabled: " << strerror(errno) << std::endl;
+        }
+    }
     for (u64 i = 0; i < virtCount; i++)
         pageState[i].init();
-    if (virtMem == MAP_FAILED)
-        die("mmap failed");
 
-    libaioInterface.reserve(maxWorkerThreads);
-    for (unsigned i = 0; i < maxWorkerThreads; i++)
-        libaioInterface.emplace_back(LibaioInterface(blockfd, virtMem));
+    // process_madvise only accepts MADV_DONTNEED for the calling process since Linux 6.13, probe on the unused tail
+    useProcessMadvise = false;
+#ifdef SYS_process_madvise
+    pidfd = envOr("PROCESS_MADVISE", 1) ? syscall(SYS_pidfd_open, getpid(), 0) : -1;
+    if (pidfd >= 0) {
+        iovec probe{virtMem + virtCount, pageSize};
+        useProcessMadvise = syscall(SYS_process_madvise, pidfd, &probe, 1, MADV_DONTNEED, 0) == pageSize;
+        if (!useProcessMadvise)
+            close(pidfd);
+    }
+#endif
 
-    physUsedCount = 0;
-    allocCount = 1; // pid 0 reserved for meta data
+    const char *ioBackend = getenv("IO_BACKEND") ? getenv("IO_BACKEND") : "libaio";
+    bool useUring = false;
+    if (strcmp(ioBackend, "uring") == 0) {
+        UringInterface::depth = envOr("URING_DEPTH", 256);
+        UringInterface::sqpoll = envOr("URING_SQPOLL", 0);
+        UringInterface::iopoll = envOr("URING_IOPOLL", 0);
+        useUring = UringInterface::probe(store);
+        if (!useUring)
+            std::cerr << "io_uring unavailable, falling back to libaio" << std::endl;
+    } else if (strcmp(ioBackend, "libaio") != 0) {
+        std::cerr << "unknown IO_BACKEND '" << ioBackend << "'" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    // eviction threads use the slots after the worker threads, followed by the sync slot
+    ioInterface.reserve(syncIoSlot + 1);
+    for (unsigned i = 0; i <= syncIoSlot; i++) {
+        if (useUring)
+            ioInterface.emplace_back(std::make_unique<UringInterface>(store, virtMem));
+        else
+            ioInterface.emplace_back(std::make_unique<LibaioInterface>(store, virtMem));
+    }
+
+    // pid 0 reserved for meta data, pid 1 for the superblock, followed by the pinned region
+    pinnedCount = envOr("PINNEDMB", 0) * 1024 * 1024 / pageSize;
+    if (firstPinnedPid + pinnedCount >= virtCount) {
+        std::cerr << "PINNEDMB exceeds VIRTGB" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    pinnedNext = firstPinnedPid;
+    pinnedUsed = 0;
+    pinnedFallbacks = 0;
+    allocCount = firstPinnedPid + pinnedCount;
+    freeListSize = 0;
+    redoing = false;
+    allocChunk = std::max<u64>(1, envOr("ALLOC_CHUNK", 64));
+    punchHoles = envOr("PUNCH_HOLE", 0);
     readCount = 0;
     writeCount = 0;
+    promoteFaults = std::max<u64>(1, envOr("FAST_FAULTS", 2));
+    promotions = 0;
+    demotions = 0;
+    demotionStop = false;
+    if (store.fastSlots)
+        demotionThread = std::thread([this] { demotionThreadLoop(); });
+    fastReads = 0;
+    suspendedFaults = 0;
+    slowReadLatency = envOr("SLOW_LATENCY_US", 0);
     batch = 32;
 
-    std::cerr << "vmcache " << "blk:" << path << " virtgb:" << virtSize / gb << " physgb:" << physSize / gb << " exmap:"
-              << useExmap << std::endl;
+    treeCount = 0;
+    persist = envOr("PERSIST", 0);
+    reopened = envOr("REOPEN", 0);
+    if (reopened)
+        reopen();
+    if (pinnedCount && envOr("PINNED_HUGE", 0))
+        madvise(virtMem + firstPinnedPid, pinnedCount * pageSize, MADV_HUGEPAGE);
+    // periodic fuzzy checkpoints, interval in seconds, bandwidth in MB/s
+    checkpointInterval = envOr("CHECKPOINT_INTERVAL", 0);
+    checkpointBandwidth = envOr("CHECKPOINT_MBPS", 0) * 1024 * 1024;
+    checkpointStop = false;
+    if (checkpointInterval)
+        checkpointThread = std::thread([this] { checkpointThreadLoop(); });
+
+    freeLowPercent = envOr("EVICT_FREE_LOW", 10);
+    freeHighPercent = envOr("EVICT_FREE_HIGH", 15);
+    updateWatermarks();
+    evictionWakeup = 0;
+    evictionSleeping = 0;
+    evictionStop = false;
+    u64 evictionThreadCount = envOr("EVICT_THREADS", 0);
+    if (evictionThreadCount > maxEvictionThreads) {
+        std::cerr << "too many eviction threads" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < evictionThreadCount; i++)
+        evictionThreads.emplace_back([this, i] { evictionThreadLoop(i); });
+
+    std::cerr << "vmcache " << "blk:" << path << " virtgb:" << virtSize / gb << " physgb:" << physSize / gb
+              << " physgb_max:" << physCountMax * pageSize / gb << " exmap:" << useExmap;
+    std::cerr << " devices:" << store.stripeCount << " fast_slots:" << store.fastSlots
+              << " ztier_bytes:" << compressedTier.capacity * compressedTier.shardCount;
+    std::cerr << " pinned_pages:" << pinnedCount << " numa_nodes:" << numaNodeCount
+              << " shards:" << residentSet.shardCount;
+    std::cerr << " evict_threads:" << evictionThreadCount << " policy:" << policy->name()
+              << " io:" << (useUring ? "uring" : "libaio") << " process_madvise:" << useProcessMadvise;
+    std::cerr << " lock_park:" << PageState::parking << " reopen:" << reopened
+              << " checkpoint_interval:" << checkpointInterval << std::endl;
+}
+
+BufferManager::~BufferManager() {
+    evictionStop = true;
+    evictionWakeup++;
+    evictionWakeup.notify_all();
+    for (auto &t: evictionThreads)
+        t.join();
+    if (demotionThread.joinable()) {
+        {
+            std::unique_lock lock(demotionMutex);
+            demotionStop = true;
+        }
+        demotionWakeup.notify_all();
+        demotionThread.join();
+    }
+    if (checkpointThread.joinable()) {
+        {
+            std::unique_lock lock(checkpointMutex);
+            checkpointStop = true;
+        }
+        checkpointWakeup.notify_all();
+        checkpointThread.join();
+    }
+    if (persist)
+        sync();
+}
+
+void BufferManager::reopen() {
+    Page *buffer = (Page *) aligned_alloc(pageSize, pageSize);
+    store.readPages(superblockPid, 1, buffer);
+    memcpy(&superblock, buffer, sizeof(Superblock));
+    free(buffer);
+    if (superblock.magic != Superblock::magicValue || superblock.pageSize != pageSize) {
+        // with several devices the superblock is only found with the striping it was written with
+        std::cerr << "BLOCK does not contain a compatible superblock, check the devices and STRIPE" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    u64 stripeExtent = store.striping == PageStore::Striping::Extent ? store.extentPages : 0;
+    if (superblock.deviceCount != store.stripeCount || superblock.stripeExtent != stripeExtent) {
+        std::cerr << "BLOCK devices or striping differ from the persisted ones" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (superblock.fastSlots != store.fastSlots) {
+        std::cerr << "FAST_BLOCK or FAST_MB differ from the persisted ones" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (superblock.allocCount > virtCount) {
+        std::cerr << "VIRTGB too small for persisted data" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (superblock.pinnedCount != pinnedCount)
+        std::cerr << "using persisted pinned region size of " << superblock.pinnedCount << " pages" << std::endl;
+    pinnedCount = superblock.pinnedCount;
+    pinnedNext = superblock.pinnedNext;
+    allocCount = superblock.allocCount;
+    if (store.fastSlots)
+        store.readFastMap(allocCount);
+    for (PID pid = firstPinnedPid + pinnedCount; pid < allocCount; pid++)
+        pageState[pid].stateAndVersion.store(PageState::sameVersion(0, PageState::Evicted), std::memory_order_relaxed);
+    // page 0 and pinned pages are never evicted, so they must be resident
+    readPage(0);
+    store.readPages(firstPinnedPid, pinnedNext - firstPinnedPid, virtMem + firstPinnedPid);
+    for (PID pid = firstPinnedPid; pid < pinnedNext; pid++)
+        store.decode(virtMem + pid);
+    readCount += pinnedNext - firstPinnedPid;
+    readFreeList();
+    pinnedUsed = pinnedNext - firstPinnedPid - pinnedFreeList.size();
+}
+
+unsigned BufferManager::registerTree() {
+    unsigned tree = treeCount++;
+    if (tree >= Superblock::maxTrees) {
+        std::cerr << "too many trees" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (reopened && tree >= superblock.treeCount) {
+        std::cerr << "tree " << tree << " was not persisted" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return tree;
+}
+
+// pids reserved by this thread, handed out by allocPage without touching allocCount
+struct PidChunk {
+    // taken with fetch_add, so sync can steal the rest of the chunk with an exchange
+    std::atomic<PID> next{0};
+    // only changed by the owning thread under pidChunkMutex
+    PID end = 0;
+
+    PidChunk() {
+        std::unique_lock lock(bm.pidChunkMutex);
+        bm.pidChunks.push_back(this);
+    }
+
+    ~PidChunk() {
+        std::unique_lock lock(bm.pidChunkMutex);
+        bm.pidChunks.erase(std::find(bm.pidChunks.begin(), bm.pidChunks.end(), this));
+        PID begin = next.exchange(end);
+        if (begin < end)
+            bm.returnPids(begin, end);
+    }
+};
+
+static thread_local PidChunk pidChunk;
+
+void BufferManager::sync(u64 maxBytesPerSecond) {
+    NOSYNC_ABORT;
+    if (useExmap)
+        abort();
+    std::unique_lock lock(syncMutex);
+    PageIoInterface &io = *ioInterface[syncIoSlot];
+    // records with smaller lsns belong to modifications whose pages are dirty before this point, so they are written
+    u64 checkpointLsn = wal.beginCheckpoint();
+
+    // collect dirty resident pages without locking them, then write them in pid order
+    std::vector<PID> dirty;
+    residentSet.forEach([&](PID pid) {
+        if (virtMem[pid].tagAndDirty.dirty())
+            dirty.push_back(pid);
+    });
+    for (PID pid = firstPinnedPid; pid < std::min<u64>(pinnedNext, firstPinnedPid + pinnedCount); pid++)
+        if (virtMem[pid].tagAndDirty.dirty())
+            dirty.push_back(pid);
+    std::sort(dirty.begin(), dirty.end());
+
+    // pages are only locked in shared mode for the duration of one batch write
+    auto start = std::chrono::steady_clock::now();
+    u64 bytesWritten = 0;
+    std::vector<PID> toWrite;
+    toWrite.reserve(batch);
+    for (u64 begin = 0; begin < dirty.size(); begin += batch) {
+        for (u64 i = begin; i < std::min<u64>(begin + batch, dirty.size()); i++) {
+            PID pid = dirty[i];
+            PageState &ps = getPageState(pid);
+            for (u64 repeatCounter = 0;; repeatCounter++) {
+                u64 v = ps.stateAndVersion.load();
+                // evicted pages have been written by eviction
+                if (PageState::getState(v) == PageState::Evicted)
+                    break;
+                if (ps.tryLockS(v)) {
+                    if (virtMem[pid].tagAndDirty.dirty())
+                        toWrite.push_back(pid);
+                    else
+                        ps.unlockS();
+                    break;
+                }
+                ps.wait(v, repeatCounter);
+            }
+        }
+        // log records before the pages they describe
+        u64 maxLsn = 0;
+        for (PID pid: toWrite)
+            maxLsn = std::max<u64>(maxLsn, pageLsn[pid].load(std::memory_order_relaxed));
+        wal.waitDurable(maxLsn);
+        io.writePages(toWrite);
+        writeCount += toWrite.size();
+        for (PID pid: toWrite)
+            getPageState(pid).unlockS();
+        bytesWritten += toWrite.size() * pageSize;
+        toWrite.clear();
+        if (maxBytesPerSecond)
+            std::this_thread::sleep_until(start + std::chrono::microseconds(bytesWritten * 1000000 / maxBytesPerSecond));
+    }
+
+    // page 0 is not in the resident set, write it unconditionally
+    fixS(0);
+    toWrite.push_back(0);
+    wal.waitDurable(pageLsn[0].load(std::memory_order_relaxed));
+    io.writePages(toWrite);
+    writeCount++;
+    unfixS(0);
+
+    // read allocCount after writing, so it covers all pids referenced by the written pages
+    superblock.fuzzyCheckpoints++;
+    superblock.checkpointLsn = checkpointLsn;
+    std::vector<PID> previousFreeListPages = freeListPages;
+    writeFreeList();
+    writeSuperblock();
+    wal.truncate(checkpointLsn);
+    // the pages of the previous free list are no longer referenced
+    std::unique_lock freeListLock(freeListMutex);
+    freeList.insert(freeList.end(), previousFreeListPages.begin(), previousFreeListPages.end());
+    freeListSize += previousFreeListPages.size();
+}
+
+void BufferManager::checkpointThreadLoop() {
+    std::unique_lock lock(checkpointMutex);
+    while (!checkpointStop) {
+        checkpointWakeup.wait_for(lock, std::chrono::seconds(checkpointInterval));
+        if (checkpointStop)
+            break;
+        lock.unlock();
+        sync(checkpointBandwidth);
+        lock.lock();
+    }
+}
+
+void BufferManager::writeFreeList() {
+    // unused pids of per-thread chunks are referenced by no page, without this they would leak on reopen
+    {
+        std::unique_lock lock(pidChunkMutex);
+        for (PidChunk *chunk: pidChunks) {
+            PID begin = chunk->next.exchange(chunk->end);
+            if (begin < chunk->end)
+                returnPids(begin, chunk->end);
+        }
+    }
+
+    // a page holds the pid of the next page, the number of pids and the pids
+    u64 perPage = pageSize / sizeof(PID) - 2;
+    std::vector<PID> pids;
+    std::vector<PID> chain;
+    {
+        std::unique_lock lock(freeListMutex);
+        u64 pageCount = (freeList.size() + pinnedFreeList.size() + freeListPages.size() + perPage - 1) / perPage;
+        while (chain.size() < pageCount && !freeList.empty()) {
+            chain.push_back(freeList.back());
+            freeList.pop_back();
+            freeListSize--;
+        }
+        pids = freeList;
+        pids.insert(pids.end(), pinnedFreeList.begin(), pinnedFreeList.end());
+        // the previous chain is free once the superblock written next replaced it
+        pids.insert(pids.end(), freeListPages.begin(), freeListPages.end());
+        if (chain.size() < pageCount) {
+            PID first = allocCount.fetch_add(pageCount - chain.size());
+            if (first + pageCount - chain.size() > virtCount) {
+                std::cerr << "VIRTGB is too low" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            // they go to the free list once the next checkpoint replaced them, which expects free pages evicted
+            for (PID pid = first; chain.size() < pageCount; pid++) {
+                getPageState(pid).stateAndVersion.store(PageState::sameVersion(0, PageState::Evicted));
+                chain.push_back(pid);
+            }
+        }
+    }
+
+    PID *buffer = (PID *) aligned_alloc(pageSize, pageSize);
+    for (u64 i = 0; i < chain.size(); i++) {
+        // pageCount was computed before the chain pids were taken, so the last pages may be empty
+        u64 begin = std::min<u64>(i * perPage, pids.size());
+        u64 count = std::min<u64>(perPage, pids.size() - begin);
+        memset(buffer, 0, pageSize);
+        buffer[0] = i + 1 < chain.size() ? chain[i + 1] : 0;
+        buffer[1] = count;
+        memcpy(buffer + 2, pids.data() + begin, count * sizeof(PID));
+        store.writePages(chain[i], 1, reinterpret_cast<Page *>(buffer));
+    }
+    free(buffer);
+    writeCount += chain.size();
+    superblock.freeListHead = chain.empty() ? 0 : chain[0];
+    freeListPages = std::move(chain);
+}
+
+void BufferManager::readFreeList() {
+    PID *buffer = (PID *) aligned_alloc(pageSize, pageSize);
+    u64 perPage = pageSize / sizeof(PID) - 2;
+    for (PID page = superblock.freeListHead; page;) {
+        if (page >= allocCount) {
+            std::cerr << "persisted free list is corrupt" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        store.readPages(page, 1, reinterpret_cast<Page *>(buffer));
+        readCount++;
+        // stays reserved until the first checkpoint of this run wrote a new chain
+        freeListPages.push_back(page);
+        u64 count = std::min<u64>(buffer[1], perPage);
+        for (u64 i = 0; i < count; i++) {
+            PID pid = buffer[2 + i];
+            if (isPinned(pid)) {
+                pinnedFreeList.push_back(pid);
+            } else {
+                freeList.push_back(pid);
+                freeListSize++;
+            }
+        }
+        page = buffer[0];
+    }
+    free(buffer);
+}
+
+void BufferManager::writeSuperblock() {
+    superblock.magic = Superblock::magicValue;
+    superblock.pageSize = pageSize;
+    superblock.allocCount = allocCount;
+    superblock.pinnedCount = pinnedCount;
+    superblock.pinnedNext = std::min<u64>(pinnedNext, firstPinnedPid + pinnedCount);
+    superblock.treeCount = treeCount;
+    superblock.deviceCount = store.stripeCount;
+    superblock.stripeExtent = store.striping == PageStore::Striping::Extent ? store.extentPages : 0;
+    superblock.fastSlots = store.fastSlots;
+    Page *buffer = (Page *) aligned_alloc(pageSize, pageSize);
+    memset((void *) buffer, 0, pageSize);
+    memcpy((void *) buffer, &superblock, sizeof(Superblock));
+    // fuzzy like the pages, tier moves concurrent with a checkpoint are only consistent after the next one
+    if (store.fastSlots)
+        store.writeFastMap();
+    // all pages and the slot map must be durable before the superblock references them
+    store.syncAll();
+    store.writePages(superblockPid, 1, buffer);
+    store.syncAll();
+    free(buffer);
 }
 
 void BufferManager::ensureFreePages() {
-    if (physUsedCount >= physCount * 0.95)
+    u64 used = physUsedCount.load();
+    if (!evictionThreads.empty() && used + freeLow >= physCount && evictionSleeping.load() > 0) {
+        evictionWakeup++;
+        evictionWakeup.notify_all();
+    }
+    if (used >= foregroundCount * 0.95)
+        evict();
+}
+
+void BufferManager::evictionThreadLoop(unsigned id) {
+    workerThreadId = maxWorkerThreads + id;
+    while (!evictionStop) {
+        if (physUsedCount.load() + freeHigh > physCount) {
+            evict();
+            lowerForegroundCount();
+            continue;
+        }
+        // announce sleep before re-checking, so ensureFreePages either sees us sleeping or we see its allocation
+        evictionSleeping++;
+        u64 w = evictionWakeup.load();
+        if (physUsedCount.load() + freeLow < physCount && !evictionStop)
+            evictionWakeup.wait(w);
+        evictionSleeping--;
+    }
+}
+
+void BufferManager::updateWatermarks() {
+    u64 low = physCount * freeLowPercent / 100;
+    freeHigh = std::max(low, physCount * freeHighPercent / 100);
+    freeLow = low;
+}
+
+void BufferManager::lowerForegroundCount() {
+    u64 current = foregroundCount.load();
+    if (current <= physCount)
+        return;
+    // just above the level at which foreground threads evict
+    u64 lowered = std::max<u64>(physCount, physUsedCount.load() * 100 / 95 + batch);
+    if (lowered < current)
+        foregroundCount.compare_exchange_strong(current, lowered);
+}
+
+bool BufferManager::resize(u64 physBytes) {
+    // keep enough frames for a few eviction batches
+    u64 count = physBytes / pageSize;
+    if (count > physCountMax || count < 1024) {
+        std::cerr << "cannot resize to " << physBytes / mb << " MB, the pool must be between " << 1024 * pageSize / mb
+                  << " MB and PHYSGB_MAX" << std::endl;
+        return false;
+    }
+    std::unique_lock lock(resizeMutex);
+    physSize = count * pageSize;
+    physCount = count;
+    updateWatermarks();
+    policy->resized(count);
+    if (evictionThreads.empty() || count >= foregroundCount)
+        foregroundCount = count;
+    if (!evictionThreads.empty()) {
+        evictionWakeup++;
+        evictionWakeup.notify_all();
+        return true;
+    }
+    // evict with the io interface of sync until foreground threads would not evict anymore
+    std::unique_lock syncLock(syncMutex);
+    uint16_t previousId = workerThreadId;
+    workerThreadId = syncIoSlot;
+    while (physUsedCount.load() >= physCount * 0.95)
         evict();
+    workerThreadId = previousId;
+    return true;
+}
+
+void BufferManager::returnPids(PID begin, PID end) {
+    end = std::min(end, virtCount);
+    std::unique_lock lock(freeListMutex);
+    for (PID pid = begin; pid < end; pid++) {
+        // allocPage expects free pages to be evicted
+        getPageState(pid).stateAndVersion.store(PageState::sameVersion(0, PageState::Evicted));
+        freeList.push_back(pid);
+        freeListSize++;
+    }
 }
 
 // allocated new page and fix it
 Page *BufferManager::allocPage() {
-    physUsedCount++;
+    physUsedCount.add(1);
     ensureFreePages();
-    u64 pid = allocCount++;
-    if (pid >= virtCount) {
-        std::cerr << "VIRTGB is too low" << std::endl;
-        exit(EXIT_FAILURE);
+    PID pid = ~0ull;
+    if (freeListSize > 0) {
+        std::unique_lock lock(freeListMutex);
+        if (!freeList.empty()) {
+            pid = freeList.back();
+            freeList.pop_back();
+            freeListSize--;
+        }
+    }
+    if (pid != ~0ull) {
+        PageState &ps = getPageState(pid);
+        for (u64 repeatCounter = 0;; repeatCounter++) {
+            u64 v = ps.stateAndVersion.load();
+            u64 state = PageState::getState(v);
+            if (state == PageState::Evicted) {
+                if (ps.tryLockX(v)) {
+                    residentSet.insert(pid);
+                    policy->inserted(pid, false);
+                    chargeTree(pid, false);
+                    break;
+                }
+            } else if (state == PageState::Unlocked || state == PageState::Marked) {
+                // a reader with a stale pointer faulted the free page in again, it is already resident
+                if (ps.tryLockX(v)) {
+                    physUsedCount.add(-1);
+                    unchargeTree(pid, false);
+                    chargeTree(pid, false);
+                    break;
+                }
+            }
+            ps.wait(v, repeatCounter);
+        }
+    } else {
+        pid = pidChunk.next.fetch_add(1);
+        if (pid >= pidChunk.end) {
+            std::unique_lock lock(pidChunkMutex);
+            pid = allocCount.fetch_add(allocChunk);
+            pidChunk.end = pid + allocChunk;
+            pidChunk.next = pid + 1;
+        }
+        if (pid >= virtCount) {
+            std::cerr << "VIRTGB is too low" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        u64 stateAndVersion = getPageState(pid).stateAndVersion;
+        bool succ = getPageState(pid).tryLockX(stateAndVersion);
+        assert(succ);
+        residentSet.insert(pid);
+        policy->inserted(pid, false);
+        chargeTree(pid, false);
     }
-    u64 stateAndVersion = getPageState(pid).stateAndVersion;
-    bool succ = getPageState(pid).tryLockX(stateAndVersion);
-    assert(succ);
-    residentSet.insert(pid);
 
     if (useExmap) {
         abort();
     }
     virtMem[pid].tagAndDirty.set_dirty(true);
+    if (structureChange)
+        structureChange->allocated.push_back(pid);
+
+    return virtMem + pid;
+}
+
+
+Page *BufferManager::allocPinnedPage() {
+    PID pid = ~0ull;
+    {
+        std::unique_lock lock(freeListMutex);
+        if (!pinnedFreeList.empty()) {
+            pid = pinnedFreeList.back();
+            pinnedFreeList.pop_back();
+        }
+    }
+    if (pid == ~0ull) {
+        pid = pinnedNext++;
+        if (pid >= firstPinnedPid + pinnedCount) {
+            pinnedFallbacks++;
+            return allocPage();
+        }
+    }
+    // free pinned pages stay resident and unlocked
+    PageState &ps = getPageState(pid);
+    for (u64 repeatCounter = 0;; repeatCounter++) {
+        u64 v = ps.stateAndVersion.load();
+        if (PageState::getState(v) == PageState::Unlocked && ps.tryLockX(v))
+            break;
+        ps.wait(v, repeatCounter);
+    }
+    pinnedUsed++;
+    virtMem[pid].tagAndDirty.set_dirty(true);
+    if (structureChange)
+        structureChange->allocated.push_back(pid);
+    return virtMem + pid;
+}
+
+void BufferManager::freePage(PID pid) {
+    NOSYNC_ABORT;
+    assert(getPageState(pid).getState() == PageState::Locked);
+    if (isPinned(pid)) {
+        // keep the frame, bumping the version makes optimistic readers restart
+        getPageState(pid).unlockX();
+        pinnedUsed--;
+        if (structureChange)
+            structureChange->freed.push_back(pid);
+        else
+            releasePid(pid);
+        return;
+    }
+    bool succ = residentSet.remove(pid);
+    assert(succ);
+    policy->removed(pid);
+    unchargeTree(pid, false);
+    pageOwner[pid].store(0, std::memory_order_relaxed);
+    if (useExmap) {
+        abort();
+    }
+    madvise(virtMem + pid, pageSize, MADV_DONTNEED);
+    PageStore::Location location = store.locate(pid);
+    if (punchHoles && fallocate(store.fds[location.device], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                location.offset, pageSize)) {
+        std::cerr << "cannot punch hole: " << strerror(errno) << ", disabling PUNCH_HOLE" << std::endl;
+        punchHoles = false;
+    }
+    store.releaseFastSlot(pid);
+    physUsedCount.add(-1);
+    getPageState(pid).unlockXEvicted();
+    // the structure modification hands out the pid again once the change is logged
+    if (structureChange)
+        structureChange->freed.push_back(pid);
+    else
+        releasePid(pid);
+}
 
+void BufferManager::releasePid(PID pid) {
+    std::unique_lock lock(freeListMutex);
+    if (redoing) {
+        redoFreePids.insert(pid);
+        if (!isPinned(pid))
+            freeListSize++;
+    } else if (isPinned(pid)) {
+        pinnedFreeList.push_back(pid);
+    } else {
+        freeList.push_back(pid);
+        freeListSize++;
+    }
+}
+
+void BufferManager::beginRedo() {
+    syncMutex.lock();
+    std::unique_lock lock(freeListMutex);
+    redoing = true;
+    redoFreePids.insert(freeList.begin(), freeList.end());
+    redoFreePids.insert(pinnedFreeList.begin(), pinnedFreeList.end());
+    redoReservedPids.insert(freeListPages.begin(), freeListPages.end());
+    freeList.clear();
+    pinnedFreeList.clear();
+}
+
+void BufferManager::endRedo() {
+    {
+        std::unique_lock lock(freeListMutex);
+        for (PID pid: redoFreePids)
+            (isPinned(pid) ? pinnedFreeList : freeList).push_back(pid);
+        redoFreePids.clear();
+        redoReservedPids.clear();
+        redoing = false;
+    }
+    syncMutex.unlock();
+}
+
+Page *BufferManager::redoPage(PID pid) {
+    assert(redoing);
+    // page 0 and pinned pages are always resident
+    if (pid == 0)
+        return fixX(pid);
+    if (isPinned(pid)) {
+        {
+            std::unique_lock lock(freeListMutex);
+            if (pid >= pinnedNext) {
+                for (PID skipped = pinnedNext; skipped < pid; skipped++)
+                    redoFreePids.insert(skipped);
+                pinnedNext = pid + 1;
+                pinnedUsed++;
+            } else if (redoFreePids.erase(pid)) {
+                pinnedUsed++;
+            }
+        }
+        return fixX(pid);
+    }
+    {
+        std::unique_lock lock(freeListMutex);
+        if (pid >= allocCount) {
+            if (pid >= virtCount) {
+                std::cerr << "VIRTGB too small for the log" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            // pids skipped over were allocated after the checkpoint and are free, or not referenced by the log
+            for (PID skipped = allocCount; skipped <= pid; skipped++) {
+                getPageState(skipped).stateAndVersion.store(PageState::sameVersion(0, PageState::Evicted));
+                if (skipped < pid) {
+                    redoFreePids.insert(skipped);
+                    freeListSize++;
+                }
+            }
+            allocCount = pid + 1;
+        } else if (redoFreePids.erase(pid)) {
+            freeListSize--;
+        }
+    }
+    // like allocPage, the image replaces the contents, so an evicted page is not read
+    physUsedCount.add(1);
+    ensureFreePages();
+    PageState &ps = getPageState(pid);
+    for (u64 repeatCounter = 0;; repeatCounter++) {
+        u64 v = ps.stateAndVersion.load();
+        u64 state = PageState::getState(v);
+        if (state == PageState::Evicted) {
+            if (ps.tryLockX(v)) {
+                residentSet.insert(pid);
+                policy->inserted(pid, false);
+                chargeTree(pid, false);
+                break;
+            }
+        } else if (state == PageState::Unlocked || state == PageState::Marked) {
+            if (ps.tryLockX(v)) {
+                physUsedCount.add(-1);
+                break;
+            }
+        }
+        ps.wait(v, repeatCounter);
+    }
     return virtMem + pid;
 }
 
+void BufferManager::redoFree(PID pid) {
+    // pages of the persisted free list stay reserved until the next checkpoint replaced it
+    if (redoReservedPids.count(pid))
+        return;
+    redoPage(pid);
+    freePage(pid);
+}
 
 void BufferManager::handleFault(PID pid) {
     NOSYNC_ABORT;
-    physUsedCount++;
+    physUsedCount.add(1);
     ensureFreePages();
-    readPage(pid);
+    // faults served by the compressed tier do no io and do not count towards promotion to the fast tier
+    if (!compressedTier.take(pid, virtMem + pid, store)) {
+        readPage(pid);
+        if (store.noteFault(pid))
+            fastReads++;
+    }
     residentSet.insert(pid);
+    policy->inserted(pid, true);
+    chargeTree(pid, true);
+}
+
+void BufferManager::chargeTree(PID pid, bool fault) {
+    u8 owner = pageOwner[pid].load(std::memory_order_relaxed);
+    if (!fault || !owner) {
+        owner = currentTree;
+        pageOwner[pid].store(owner, std::memory_order_relaxed);
+    }
+    pageChances[pid].store(0, std::memory_order_relaxed);
+    if (!owner)
+        return;
+    treeFrames[owner - 1].resident.add(1);
+    if (fault)
+        treeFrames[owner - 1].misses.add(1);
+}
+
+void BufferManager::unchargeTree(PID pid, bool evicted) {
+    TreeFrames *tree = treeOf(pid);
+    if (!tree)
+        return;
+    tree->resident.add(-1);
+    if (evicted)
+        tree->evictions.add(1);
 }
 
 Page *BufferManager::fixX(PID pid) {
     NOSYNC_RET(toPtr(pid));
+    currentTreeAccesses++;
     PageState &ps = getPageState(pid);
     for (u64 repeatCounter = 0;; repeatCounter++) {
         u64 stateAndVersion = ps.stateAndVersion.load();
@@ -111,12 +904,13 @@ Page *BufferManager::fixX(PID pid) {
                 break;
             }
         }
-        vmcache_yield(repeatCounter);
+        ps.wait(stateAndVersion, repeatCounter);
     }
 }
 
 Page *BufferManager::fixS(PID pid) {
     NOSYNC_RET(toPtr(pid));
+    currentTreeAccesses++;
     PageState &ps = getPageState(pid);
     for (u64 repeatCounter = 0;; repeatCounter++) {
         u64 stateAndVersion = ps.stateAndVersion;
@@ -136,7 +930,7 @@ Page *BufferManager::fixS(PID pid) {
                     return virtMem + pid;
             }
         }
-        vmcache_yield(repeatCounter);
+        ps.wait(stateAndVersion, repeatCounter);
     }
 }
 
@@ -147,6 +941,12 @@ void BufferManager::unfixS(PID pid) {
 
 void BufferManager::unfixX(PID pid) {
     NOSYNC_RET();
+    // pages allocated by a structure modification are unlocked once it is logged, see StructureScope
+    if (structureChange && std::find(structureChange->allocated.begin(), structureChange->allocated.end(), pid) !=
+                           structureChange->allocated.end()) {
+        structureChange->released.push_back(pid);
+        return;
+    }
     getPageState(pid).unlockX();
 }
 
@@ -158,13 +958,63 @@ void setVmcacheWorkerThreadId(uint16_t x) {
     workerThreadId = x;
 }
 
+// parse a sysfs cpu or node list like "0-3,8-11"
+static std::vector<unsigned> readSysfsList(const std::string &path) {
+    std::vector<unsigned> list;
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f)
+        return list;
+    char buffer[4096];
+    if (fgets(buffer, sizeof(buffer), f)) {
+        char *p = buffer;
+        while (*p >= '0' && *p <= '9') {
+            unsigned first = strtoul(p, &p, 10);
+            unsigned last = first;
+            if (*p == '-')
+                last = strtoul(p + 1, &p, 10);
+            for (unsigned i = first; i <= last; i++)
+                list.push_back(i);
+            if (*p == ',')
+                p++;
+        }
+    }
+    fclose(f);
+    return list;
+}
+
+std::vector<NumaNode> numaNodesWithCpus() {
+    std::vector<NumaNode> nodes;
+    for (unsigned id: readSysfsList("/sys/devices/system/node/online")) {
+        auto cpus = readSysfsList("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+        if (!cpus.empty())
+            nodes.push_back({id, cpus});
+    }
+    return nodes;
+}
+
+bool numaBind(void *addr, u64 len, int mode, const std::vector<unsigned> &nodes, bool move) {
+    u64 mask = 0;
+    for (unsigned node: nodes) {
+        if (node >= 64)
+            return false;
+        mask |= 1ull << node;
+    }
+    len = (len + pageSize - 1) / pageSize * pageSize;
+    return syscall(SYS_mbind, addr, len, mode, nodes.empty() ? nullptr : &mask, nodes.empty() ? 0 : 65,
+                   move ? MPOL_MF_MOVE : 0) == 0;
+}
+
 void BufferManager::readPage(PID pid) {
     NOSYNC_ABORT;
     if (useExmap) {
         abort();
     } else {
-        int ret = pread(blockfd, virtMem + pid, pageSize, pid * pageSize);
-        if (ret != pageSize) {
+        PageStore::Location location = store.locate(pid);
+        if (slowReadLatency && !store.onFastTier(location))
+            usleep(slowReadLatency);
+        long len = store.storedSize(pid);
+        long ret = pread(store.fds[location.device], virtMem + pid, len, location.offset);
+        if (ret != len) {
             AIO_ERROR_LOCK.lock();
             std::cout << "error reading page " << pid << ":" << ret;
             if (ret < 0)
@@ -172,10 +1022,79 @@ void BufferManager::readPage(PID pid) {
             std::cout << std::endl;
             abort();
         }
+        store.decode(virtMem + pid);
         readCount++;
     }
 }
 
+void BufferManager::prefetch(std::span<PID> pids) {
+    NOSYNC_RET();
+    if (useExmap)
+        return;
+    assert(workerThreadId < ioInterface.size());
+    PageIoInterface &io = *ioInterface[workerThreadId];
+    pollReads(false);
+    std::vector<PID> toRead;
+    for (PID pid: pids) {
+        if (toRead.size() >= io.readSlotsAvailable())
+            break;
+        if (pid >= allocCount)
+            continue;
+        PageState &ps = getPageState(pid);
+        u64 v = ps.stateAndVersion.load();
+        if (PageState::getState(v) == PageState::Evicted && ps.tryLockX(v)) {
+            physUsedCount.add(1);
+            ensureFreePages();
+            if (compressedTier.take(pid, virtMem + pid, store)) {
+                residentSet.insert(pid);
+                policy->inserted(pid, true);
+                chargeTree(pid, true);
+                ps.unlockX();
+            } else {
+                toRead.push_back(pid);
+            }
+        }
+    }
+    if (toRead.empty())
+        return;
+    io.readPagesAsync(toRead);
+    asyncReadsInFlight += toRead.size();
+}
+
+void BufferManager::pollReads(bool wait, bool all) {
+    if (asyncReadsInFlight == 0)
+        return;
+    assert(workerThreadId < ioInterface.size());
+    PID completed[PageIoInterface::maxReap];
+    do {
+        u64 cnt = ioInterface[workerThreadId]->reapReads(wait ? 1 : 0, completed);
+        asyncReadsInFlight -= cnt;
+        readCount += cnt;
+        for (u64 i = 0; i < cnt; i++) {
+            store.decode(virtMem + completed[i]);
+            if (store.noteFault(completed[i]))
+                fastReads++;
+            residentSet.insert(completed[i]);
+            policy->inserted(completed[i], true);
+            chargeTree(completed[i], true);
+            getPageState(completed[i]).unlockX();
+        }
+    } while (wait && all && asyncReadsInFlight > 0);
+}
+
+bool BufferManager::faultAsync(PID pid) {
+    prefetch({&pid, 1});
+    // still evicted if there was no free read slot
+    if (PageState::getState(getPageState(pid).stateAndVersion.load()) != PageState::Locked)
+        return false;
+    suspendedFaults++;
+    return true;
+}
+
+void reapAsyncReads() {
+    bm.pollReads(false);
+}
+
 void BufferManager::evict() {
     NOSYNC_ABORT;
     std::vector<PID> toEvict;
@@ -183,41 +1102,78 @@ void BufferManager::evict() {
     std::vector<PID> toWrite;
     toWrite.reserve(batch);
 
-    // 0. find candidates, lock dirty ones in shared mode
+    // 0. find candidates, lock dirty ones and ones moving to the fast tier in shared mode
     while (toEvict.size() + toWrite.size() < batch) {
+        bool logBehind = false;
         residentSet.iterateClockBatch(batch, [&](PID pid) {
             PageState &ps = getPageState(pid);
             u64 v = ps.stateAndVersion;
+            TreeFrames *tree = treeOf(pid);
+            bool overQuota = tree && tree->overQuota();
             switch (PageState::getState(v)) {
+                case PageState::Unlocked:
+                    policy->referenced(pid);
+                    pageChances[pid].store(0, std::memory_order_relaxed);
+                    // pages of trees over their quota get no second chance
+                    if (!ps.tryMark(v) || !overQuota)
+                        break;
+                    v = PageState::sameVersion(v, PageState::Marked);
+                    [[fallthrough]];
                 case PageState::Marked:
-                    if (virtMem[pid].tagAndDirty.dirty()) {
-                        if (ps.tryLockS(v))
+                    // pages of trees over their quota are evicted regardless of the policy and priorities
+                    if (!overQuota) {
+                        if (!policy->evictable(pid))
+                            break;
+                        if (tree && pageChances[pid].load(std::memory_order_relaxed) <
+                                    tree->priority.load(std::memory_order_relaxed)) {
+                            pageChances[pid].fetch_add(1, std::memory_order_relaxed);
+                            break;
+                        }
+                    }
+                    if (virtMem[pid].tagAndDirty.dirty() || wantsPromotion(pid)) {
+                        if (!ps.tryLockS(v))
+                            break;
+                        // a page must not be written before the log records describing its changes
+                        if (wal.isDurable(pageLsn[pid].load(std::memory_order_relaxed))) {
                             toWrite.push_back(pid);
+                        } else {
+                            ps.unlockS();
+                            logBehind = true;
+                        }
                     } else {
                         toEvict.push_back(pid);
                     }
                     break;
-                case PageState::Unlocked:
-                    ps.tryMark(v);
-                    break;
                 default:
                     break; // skip
             };
         });
+        if (logBehind)
+            wal.requestFlush();
     }
 
-    assert(workerThreadId < maxWorkerThreads);
-    // 1. write dirty pages
-    libaioInterface[workerThreadId].writePages(toWrite);
-    writeCount += toWrite.size();
+    assert(workerThreadId < ioInterface.size());
+    // 1. start writing dirty pages, clean ones are only written if they got a fast tier slot
+    PageIoInterface &io = *ioInterface[workerThreadId];
+    std::vector<PID> promoted;
+    if (store.fastSlots) {
+        for (PID pid: toWrite)
+            if ((wantsPromotion(pid) && promote(pid)) || virtMem[pid].tagAndDirty.dirty())
+                promoted.push_back(pid);
+    }
+    const std::vector<PID> &written = store.fastSlots ? promoted : toWrite;
+    io.submitWrites(written);
 
-    // 2. try to lock clean page candidates
+    // 2. try to lock clean page candidates while the writes are in flight
     toEvict.erase(std::remove_if(toEvict.begin(), toEvict.end(), [&](PID pid) {
         PageState &ps = getPageState(pid);
         u64 v = ps.stateAndVersion;
         return (PageState::getState(v) != PageState::Marked) || !ps.tryLockX(v);
     }), toEvict.end());
 
+    io.completeWrites();
+    writeCount += written.size();
+
     // 3. try to upgrade lock for dirty page candidates
     for (auto &pid: toWrite) {
         PageState &ps = getPageState(pid);
@@ -229,55 +1185,938 @@ void BufferManager::evict() {
             ps.unlockS();
     }
 
-    // 4. remove from page table
+    // 4. keep compressed copies, all pages are clean now
+    if (compressedTier.enabled())
+        for (PID pid: toEvict)
+            compressedTier.insert(pid, virtMem + pid, store);
+
+    // 5. remove from page table
     if (useExmap) {
         abort();
     } else {
-        for (u64 &pid: toEvict)
-            madvise(virtMem + pid, pageSize, MADV_DONTNEED);
+        unmapPages(toEvict);
     }
 
-    // 5. remove from hash table and unlock
+    // 6. remove from hash table and unlock
     for (u64 &pid: toEvict) {
         bool succ = residentSet.remove(pid);
         assert(succ);
+        policy->removed(pid);
+        unchargeTree(pid, true);
         getPageState(pid).unlockXEvicted();
     }
 
-    physUsedCount -= toEvict.size();
+    physUsedCount.add(-static_cast<int64_t>(toEvict.size()));
+}
+
+bool BufferManager::promote(PID pid) {
+    u64 slot = ~0ull;
+    PID victim = 0;
+    {
+        std::unique_lock lock(store.tierMutex);
+        // another eviction thread may have promoted the page already
+        if (store.slotOf[pid].load() != 0)
+            return false;
+        if (!store.freeSlots.empty()) {
+            slot = store.freeSlots.back();
+            store.freeSlots.pop_back();
+        } else {
+            // all slots are taken, resident pages and pages faulted in from their slot are passed over
+            for (u64 i = 0; i < 2 * store.fastSlots && !victim; i++) {
+                u64 s = store.hand;
+                store.hand = (store.hand + 1) % store.fastSlots;
+                if (store.referenced[s].exchange(0, std::memory_order_relaxed))
+                    continue;
+                PageState &ps = getPageState(store.pidOf[s]);
+                u64 v = ps.stateAndVersion.load();
+                if (PageState::getState(v) == PageState::Evicted && ps.tryLockX(v)) {
+                    slot = s;
+                    victim = store.pidOf[s];
+                }
+            }
+            if (victim) {
+                // the eviction path does not wait for the copy, the page is promoted when it is evicted again
+                std::unique_lock demotionLock(demotionMutex);
+                demotionQueue.emplace_back(victim, slot);
+                demotionWakeup.notify_one();
+            }
+            return false;
+        }
+        store.pidOf[slot] = pid;
+    }
+    // the page is written to the slot after this returns
+    store.slotOf[pid].store(slot + 1);
+    promotions++;
+    return true;
+}
+
+void BufferManager::demote(PID pid, u64 slot, Page *buffer) {
+    if (pread(store.fds[store.fastDevice], buffer, pageSize, slot * pageSize) != pageSize)
+        die("reading fast tier");
+    PageStore::Location location = store.locateStriped(pid);
+    if (pwrite(store.fds[location.device], buffer, pageSize, location.offset) != pageSize)
+        die("writing pages failed");
+    store.slotOf[pid].store(0);
+    store.faultCount[pid].store(0, std::memory_order_relaxed);
+    {
+        std::unique_lock lock(store.tierMutex);
+        store.pidOf[slot] = 0;
+        store.referenced[slot].store(0, std::memory_order_relaxed);
+        store.freeSlots.push_back(slot);
+    }
+    demotions++;
+    getPageState(pid).unlockXEvicted();
+}
+
+void BufferManager::demotionThreadLoop() {
+    Page *buffer = (Page *) aligned_alloc(pageSize, pageSize);
+    std::unique_lock lock(demotionMutex);
+    while (true) {
+        demotionWakeup.wait(lock, [&] { return demotionStop || !demotionQueue.empty(); });
+        // queued pages are still moved on shutdown, they are locked until then
+        if (demotionQueue.empty())
+            break;
+        auto [pid, slot] = demotionQueue.front();
+        demotionQueue.pop_front();
+        lock.unlock();
+        demote(pid, slot, buffer);
+        lock.lock();
+    }
+    free(buffer);
+}
+
+void BufferManager::touchOnce(PID pid) {
+    if (isPinned(pid) || !policy->touchedOnce(pid))
+        return;
+    PageState &ps = getPageState(pid);
+    u64 v = ps.stateAndVersion.load();
+    if (PageState::getState(v) == PageState::Unlocked)
+        ps.tryMark(v);
+}
+
+void BufferManager::unmapPages(std::vector<PID> &pids) {
+    // coalesce contiguous pids into ranges
+    std::sort(pids.begin(), pids.end());
+    std::vector<iovec> ranges;
+    for (PID pid: pids) {
+        if (!ranges.empty() && reinterpret_cast<Page *>(ranges.back().iov_base) + ranges.back().iov_len / pageSize ==
+                               virtMem + pid)
+            ranges.back().iov_len += pageSize;
+        else
+            ranges.push_back({virtMem + pid, pageSize});
+    }
+    u64 done = 0;
+#ifdef SYS_process_madvise
+    // one syscall, and on recent kernels one tlb flush, per IOV_MAX ranges
+    while (useProcessMadvise && done < ranges.size()) {
+        u64 cnt = std::min<u64>(ranges.size() - done, IOV_MAX);
+        u64 bytes = 0;
+        for (u64 i = done; i < done + cnt; i++)
+            bytes += ranges[i].iov_len;
+        if (syscall(SYS_process_madvise, pidfd, ranges.data() + done, cnt, MADV_DONTNEED, 0) != static_cast<long>(bytes))
+            break; // partial failure, fall back to madvise for the remaining ranges
+        done += cnt;
+    }
+#endif
+    for (u64 i = done; i < ranges.size(); i++)
+        madvise(ranges[i].iov_base, ranges[i].iov_len, MADV_DONTNEED);
 }
 
 void PageState::init() { stateAndVersion.store(sameVersion(0, Unlocked), std::memory_order_release); }
 
-ResidentPageSet::ResidentPageSet(u64 maxCount) : count(next_pow2(maxCount * 1.5)), mask(count - 1), clockPos(0) {
-    ht = (Entry *) allocHuge(count * sizeof(Entry));
-    memset((void *) ht, 0xFF, count * sizeof(Entry));
+bool PageState::parking = false;
+std::atomic<u32> PageState::parkedWaiters[PageState::parkBuckets];
+
+void PageState::park(u64 observed) {
+    std::atomic<u32> &waiters = parkBucket();
+    waiters.fetch_add(1);
+    if (stateAndVersion.load() == observed) {
+        // the timeout bounds the damage of a missed wake-up
+        timespec timeout{0, 1000 * 1000};
+        syscall(SYS_futex, futexWord(), FUTEX_WAIT_PRIVATE, static_cast<u32>(observed >> 32), &timeout, nullptr, 0);
+    }
+    waiters.fetch_sub(1);
 }
 
-void LibaioInterface::writePages(const std::vector<PID> &pages) {
-    if (pages.size() >= maxIOs) {
-        std::cerr << "too many pages to write" << std::endl;
-        abort();
+void PageState::wait(u64 observed, u64 repeatCounter) {
+    // the lock may be held by one of our own prefetch reads
+    if (asyncReadsInFlight)
+        reapAsyncReads();
+    if (!parking) {
+        _mm_pause();
+        return;
     }
-    for (u64 i = 0; i < pages.size(); i++) {
-        PID pid = pages[i];
-        virtMem[pid].tagAndDirty.set_dirty(false);
-        cbPtr[i] = &cb[i];
-        io_prep_pwrite(cb + i, blockfd, &virtMem[pid], pageSize, pageSize * pid);
-    }
-    int cnt = io_submit(ctx, pages.size(), cbPtr);
-    assert(cnt == pages.size());
-    cnt = io_getevents(ctx, pages.size(), pages.size(), events, nullptr);
-    assert(cnt == pages.size());
-    for (int i = 0; i < cnt; ++i) {
-        signed long ret = events[i].res;
-        if (ret != pageSize) {
-            AIO_ERROR_LOCK.lock();
-            std::cout << "error writing page :" << ret;
-            if (ret < 0)
-                std::cout << ". " << strerror(-ret);
-            std::cout << std::endl;
+    if (repeatCounter < spinRounds) {
+        for (u64 i = 0; i < (1ull << repeatCounter); i++)
+            _mm_pause();
+        return;
+    }
+    // Exclusive locks may be held during io, shared ones are short. Our own reads would not complete while we sleep.
+    if (getState(observed) == Locked && asyncReadsInFlight == 0)
+        park(observed);
+    else
+        std::this_thread::yield();
+}
+
+ResidentPageSet::ResidentPageSet(u64 maxCount, u64 shardCount) : shardCount(shardCount) {
+    if (shardCount == 0 || shardCount > maxShards || (shardCount & (shardCount - 1)) != 0) {
+        std::cerr << "RESIDENT_SHARDS must be a power of two of at most " << maxShards << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    shards = new Shard[shardCount];
+    // shards fill unevenly, leave some extra room in small ones
+    u64 shardSize = next_pow2((maxCount * 1.5) / shardCount + 1024);
+    for (u64 s = 0; s < shardCount; s++) {
+        Shard &shard = shards[s];
+        shard.count = shardSize;
+        shard.mask = shardSize - 1;
+        shard.clockPos = 0;
+        shard.ht = (Entry *) allocHuge(shard.count * sizeof(Entry));
+        memset((void *) shard.ht, 0xFF, shard.count * sizeof(Entry));
+    }
+}
+
+void ResidentPageSet::placeShards(const std::vector<unsigned> &nodes) {
+    // the tables have been initialized already, move them
+    for (u64 s = 0; s < shardCount; s++)
+        numaBind(shards[s].ht, shards[s].count * sizeof(Entry), MPOL_PREFERRED, {nodes[s % nodes.size()]}, true);
+}
+
+ResidentPageSet::~ResidentPageSet() {
+    for (u64 s = 0; s < shardCount; s++)
+        munmap(shards[s].ht, shards[s].count * sizeof(Entry));
+    delete[] shards;
+}
+
+void PageStore::open(const char *pathList, u64 virtCount) {
+    for (const char *p = pathList; *p;) {
+        const char *end = strchr(p, ',');
+        paths.emplace_back(p, end ? end - p : strlen(p));
+        p = end ? end + 1 : p + strlen(p);
+    }
+    for (auto &path: paths) {
+        int fd = ::open(path.c_str(), O_RDWR | O_DIRECT, S_IRWXU);
+        if (fd == -1) {
+            std::cerr << "cannot open BLOCK device '" << path << "'" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        fds.push_back(fd);
+    }
+    const char *stripe = getenv("STRIPE") ? getenv("STRIPE") : "interleave";
+    if (strcmp(stripe, "interleave") == 0) {
+        striping = Striping::Interleave;
+    } else if (strcmp(stripe, "extent") == 0) {
+        striping = Striping::Extent;
+        extentPages = envOr("STRIPE_EXTENT", 256);
+        if (extentPages == 0) {
+            std::cerr << "STRIPE_EXTENT must not be 0" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        std::cerr << "unknown STRIPE '" << stripe << "'" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    // with a single device both are the identity
+    if (fds.size() == 1) {
+        striping = Striping::Interleave;
+        extentPages = 1;
+    }
+    stripeCount = fds.size();
+
+    const char *compress = getenv("COMPRESS") ? getenv("COMPRESS") : "none";
+    if (strcmp(compress, "none") == 0) {
+        compression = Compression::None;
+    } else if (strcmp(compress, "gap") == 0) {
+        compression = Compression::Gap;
+    } else if (strcmp(compress, "lz4") == 0) {
+#ifdef BTREE_LZ4
+        compression = Compression::Lz4;
+#else
+        std::cerr << "COMPRESS=lz4 requires building with lz4" << std::endl;
+        exit(EXIT_FAILURE);
+#endif
+    } else {
+        std::cerr << "unknown COMPRESS '" << compress << "'" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (compression != Compression::None) {
+        storedSectors = (std::atomic<u8> *) allocHuge(virtCount * sizeof(std::atomic<u8>));
+        punchTails = envOr("PUNCH_HOLE", 0);
+    }
+
+    const char *fastPath = getenv("FAST_BLOCK");
+    if (fastPath)
+        openFastTier(fastPath, virtCount);
+
+    // Pages are read whole as long as their stored size is unknown. Extend sparse files so that holds for compressed
+    // pages written at their end.
+    if (compression != Compression::None) {
+        u64 extent = stripeCount * extentPages;
+        u64 stripedSize = (virtCount + extent - 1) / extent * extentPages * pageSize;
+        for (u64 i = 0; i < fds.size(); i++) {
+            u64 size = onFastTier({static_cast<u32>(i), 0}) ? (fastSlots + fastMapPages()) * pageSize : stripedSize;
+            struct stat st;
+            if (fstat(fds[i], &st) == 0 && S_ISREG(st.st_mode) && static_cast<u64>(st.st_size) < size &&
+                ftruncate(fds[i], size) != 0)
+                die("extending BLOCK file");
+        }
+    }
+}
+
+void PageStore::openFastTier(const char *fastPath, u64 virtCount) {
+    fastSlots = envOr("FAST_MB", 1024) * 1024 * 1024 / pageSize;
+    if (fastSlots == 0 || fastSlots >= UINT32_MAX) {
+        std::cerr << "FAST_MB must be between one page and 2^32 pages" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    int fd = ::open(fastPath, O_RDWR | O_DIRECT, S_IRWXU);
+    if (fd == -1) {
+        std::cerr << "cannot open FAST_BLOCK device '" << fastPath << "'" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    fastDevice = fds.size();
+    fds.push_back(fd);
+    paths.emplace_back(fastPath);
+    // zeroed by mmap, all pages start out on the striped devices
+    slotOf = (std::atomic<u32> *) allocHuge(virtCount * sizeof(std::atomic<u32>));
+    faultCount = (std::atomic<u8> *) allocHuge(virtCount * sizeof(std::atomic<u8>));
+    referenced = std::make_unique<std::atomic<u8>[]>(fastSlots);
+    pidOf.assign(fastSlots, 0);
+    // hand out the slots in order
+    for (u64 slot = fastSlots; slot > 0; slot--)
+        freeSlots.push_back(slot - 1);
+}
+
+static_assert(pageSize / PageStore::sectorSize < 256, "stored sizes are kept in a byte");
+
+// Per thread buffers of a page, 0 is used by compression and decompression, 1 by the compressed tier.
+// Never freed, the sync on destruction of the buffer manager runs after thread locals of the main thread are gone.
+static u8 *scratchPage(unsigned index) {
+    static thread_local u8 *pages[2] = {nullptr, nullptr};
+    if (!pages[index])
+        pages[index] = (u8 *) malloc(pageSize);
+    return pages[index];
+}
+
+u64 PageStore::compressPage(PID pid, Page *page, u8 *out, u64 capacity, bool lz4) {
+    u8 *src = reinterpret_cast<u8 *>(page);
+    PageGap gap{0, 0};
+    if (pageGap)
+        gap = pageGap(pid, page);
+    if (gap.begin >= gap.end || gap.end > pageSize)
+        gap = {pageSize, pageSize};
+    CompressedHeader header{compressedMagic, lz4, 0, gap.begin, pageSize - gap.end, 0};
+    u8 *data = out + sizeof(CompressedHeader);
+#ifdef BTREE_LZ4
+    if (lz4) {
+        // lz4 needs contiguous input
+        u8 *in = scratchPage(0);
+        memcpy(in, src, header.headLen);
+        memcpy(in + header.headLen, src + gap.end, header.tailLen);
+        int len = LZ4_compress_default(reinterpret_cast<char *>(in), reinterpret_cast<char *>(data),
+                                       header.headLen + header.tailLen, capacity);
+        header.dataLen = len > 0 ? len : pageSize;
+    } else
+#endif
+    {
+        header.dataLen = header.headLen + header.tailLen;
+        if (header.dataLen <= capacity) {
+            memcpy(data, src, header.headLen);
+            memcpy(data + header.headLen, src + gap.end, header.tailLen);
+        }
+    }
+    if (header.dataLen > capacity)
+        return 0;
+    memcpy(out, &header, sizeof(CompressedHeader));
+    return sizeof(CompressedHeader) + header.dataLen;
+}
+
+u64 PageStore::encode(PID pid, Page *page, Page *out) {
+    // compressed pages must save at least one sector
+    u64 len = compressPage(pid, page, reinterpret_cast<u8 *>(out), pageSize - sectorSize - sizeof(CompressedHeader),
+                           compression == Compression::Lz4);
+    if (!len) {
+        storedSectors[pid].store(0, std::memory_order_relaxed);
+        return 0;
+    }
+    u64 stored = (len + sectorSize - 1) / sectorSize * sectorSize;
+    memset(reinterpret_cast<u8 *>(out) + len, 0, stored - len);
+    storedSectors[pid].store(stored / sectorSize, std::memory_order_relaxed);
+    return stored;
+}
+
+void PageStore::decodeCompressed(Page *page) {
+    u8 *dst = reinterpret_cast<u8 *>(page);
+    CompressedHeader header;
+    memcpy(&header, dst, sizeof(CompressedHeader));
+    u8 *data = dst + sizeof(CompressedHeader);
+    if (header.lz4) {
+#ifdef BTREE_LZ4
+        u8 *compressed = scratchPage(0);
+        memcpy(compressed, data, header.dataLen);
+        int len = LZ4_decompress_safe(reinterpret_cast<char *>(compressed), reinterpret_cast<char *>(dst),
+                                      header.dataLen, pageSize);
+        if (len != static_cast<int>(header.headLen + header.tailLen)) {
+            std::cerr << "corrupt compressed page" << std::endl;
             abort();
         }
+        data = dst;
+#else
+        std::cerr << "page is compressed with lz4, which this build does not support" << std::endl;
+        abort();
+#endif
+    }
+    // the tail moves up and the head down, so neither overwrites the other
+    memmove(dst + pageSize - header.tailLen, data + header.headLen, header.tailLen);
+    memmove(dst, data, header.headLen);
+}
+
+bool PageStore::noteFault(PID pid) {
+    if (!fastSlots)
+        return false;
+    u8 faults = faultCount[pid].load(std::memory_order_relaxed);
+    if (faults < std::numeric_limits<u8>::max())
+        faultCount[pid].store(faults + 1, std::memory_order_relaxed);
+    u32 slot = slotOf[pid].load(std::memory_order_relaxed);
+    if (!slot)
+        return false;
+    referenced[slot - 1].store(1, std::memory_order_relaxed);
+    return true;
+}
+
+void PageStore::releaseFastSlot(PID pid) {
+    if (!fastSlots)
+        return;
+    faultCount[pid].store(0, std::memory_order_relaxed);
+    u32 slot = slotOf[pid].load();
+    if (!slot)
+        return;
+    std::unique_lock lock(tierMutex);
+    pidOf[slot - 1] = 0;
+    referenced[slot - 1].store(0, std::memory_order_relaxed);
+    freeSlots.push_back(slot - 1);
+    slotOf[pid].store(0);
+}
+
+void PageStore::writeFastMap() {
+    u64 size = fastMapPages() * pageSize;
+    PID *map = (PID *) aligned_alloc(pageSize, size);
+    memset(map, 0, size);
+    {
+        std::unique_lock lock(tierMutex);
+        std::copy(pidOf.begin(), pidOf.end(), map);
+    }
+    for (u64 done = 0; done < size;) {
+        ssize_t ret = pwrite(fds[fastDevice], reinterpret_cast<u8 *>(map) + done, size - done,
+                             fastSlots * pageSize + done);
+        if (ret <= 0)
+            die("writing fast tier map failed");
+        done += ret;
+    }
+    free(map);
+}
+
+void PageStore::readFastMap(u64 allocCount) {
+    u64 size = fastMapPages() * pageSize;
+    PID *map = (PID *) aligned_alloc(pageSize, size);
+    for (u64 done = 0; done < size;) {
+        ssize_t ret = pread(fds[fastDevice], reinterpret_cast<u8 *>(map) + done, size - done,
+                            fastSlots * pageSize + done);
+        if (ret <= 0)
+            die("reading fast tier map failed");
+        done += ret;
+    }
+    freeSlots.clear();
+    for (u64 slot = fastSlots; slot > 0; slot--) {
+        PID pid = map[slot - 1];
+        if (pid != 0 && pid < allocCount) {
+            pidOf[slot - 1] = pid;
+            slotOf[pid].store(slot, std::memory_order_relaxed);
+        } else {
+            pidOf[slot - 1] = 0;
+            freeSlots.push_back(slot - 1);
+        }
     }
+    free(map);
+}
+
+void PageStore::readPages(PID first, u64 count, Page *dst) {
+    for (u64 i = 0; i < count;) {
+        Location location = locate(first + i);
+        // pids that are adjacent on the device
+        u64 run = 1;
+        while (i + run < count && locate(first + i + run).device == location.device &&
+               locate(first + i + run).offset == location.offset + run * pageSize)
+            run++;
+        for (u64 done = 0; done < run * pageSize;) {
+            ssize_t ret = pread(fds[location.device], reinterpret_cast<u8 *>(dst + i) + done, run * pageSize - done,
+                                location.offset + done);
+            if (ret <= 0)
+                die("reading pages failed");
+            done += ret;
+        }
+        i += run;
+    }
+}
+
+void PageStore::writePages(PID first, u64 count, Page *src) {
+    for (u64 i = 0; i < count; i++) {
+        Location location = locate(first + i);
+        if (pwrite(fds[location.device], src + i, pageSize, location.offset) != pageSize)
+            die("writing pages failed");
+    }
+}
+
+void PageStore::syncAll() {
+    for (int fd: fds)
+        if (fdatasync(fd) != 0)
+            die("fdatasync");
+}
+
+CompressedTier::~CompressedTier() {
+    if (!capacity)
+        return;
+    for (u64 s = 0; s < shardCount; s++)
+        munmap(shards[s].arena, capacity);
+    munmap(entryOf, virtCount * sizeof(std::atomic<u64>));
+}
+
+void CompressedTier::open(u64 virtCount, u64 defaultShards) {
+    u64 bytes = envOr("ZTIER_MB", 0) * 1024 * 1024;
+    if (!bytes)
+        return;
+    shardCount = envOr("ZTIER_SHARDS", defaultShards);
+    if (shardCount == 0 || (shardCount & (shardCount - 1)) != 0) {
+        std::cerr << "ZTIER_SHARDS must be a power of two" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    capacity = bytes / shardCount / sizeof(Entry) * sizeof(Entry);
+    if (capacity < 4 * (sizeof(Entry) + pageSize)) {
+        std::cerr << "ZTIER_MB is too small for " << shardCount << " shards" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    this->virtCount = virtCount;
+    shards = std::make_unique<Shard[]>(shardCount);
+    for (u64 s = 0; s < shardCount; s++)
+        shards[s].arena = (u8 *) allocHuge(capacity);
+    // zeroed by mmap
+    entryOf = (std::atomic<u64> *) allocHuge(virtCount * sizeof(std::atomic<u64>));
+#ifdef BTREE_LZ4
+    lz4 = true;
+#endif
+}
+
+void CompressedTier::insert(PID pid, Page *page, PageStore &store) {
+    u8 *buffer = scratchPage(1);
+    // copies that are not smaller than the page are not kept
+    u64 len = store.compressPage(pid, page, buffer, pageSize - sizeof(PageStore::CompressedHeader) - sizeof(Entry),
+                                 lz4);
+    if (!len)
+        return;
+    u64 size = sizeof(Entry) + (len + sizeof(Entry) - 1) / sizeof(Entry) * sizeof(Entry);
+    Shard &shard = shardFor(pid);
+    std::unique_lock lock(shard.mutex);
+    u64 offset = shard.head % capacity;
+    if (offset + size > capacity) {
+        // entries do not wrap around, skip the end of the arena
+        makeRoom(shard, capacity - offset);
+        Entry padding{~0ull, capacity - offset - sizeof(Entry)};
+        memcpy(shard.arena + offset, &padding, sizeof(Entry));
+        shard.head += capacity - offset;
+        offset = 0;
+    }
+    makeRoom(shard, size);
+    Entry entry{pid, len};
+    memcpy(shard.arena + offset, &entry, sizeof(Entry));
+    memcpy(shard.arena + offset + sizeof(Entry), buffer, len);
+    entryOf[pid].store(shard.head + 1, std::memory_order_relaxed);
+    shard.head += size;
+    stores++;
+}
+
+bool CompressedTier::take(PID pid, Page *frame, PageStore &store) {
+    // copies are only added for pages that are locked exclusively, like this one
+    if (!capacity || !entryOf[pid].load(std::memory_order_relaxed))
+        return false;
+    Shard &shard = shardFor(pid);
+    {
+        std::unique_lock lock(shard.mutex);
+        u64 position = entryOf[pid].load(std::memory_order_relaxed);
+        if (!position)
+            return false;
+        u8 *p = shard.arena + (position - 1) % capacity;
+        Entry entry;
+        memcpy(&entry, p, sizeof(Entry));
+        memcpy((void *) frame, p + sizeof(Entry), entry.len);
+        // the space is reclaimed when the tail passes it
+        entryOf[pid].store(0, std::memory_order_relaxed);
+    }
+    store.decode(frame);
+    hits++;
+    return true;
+}
+
+void CompressedTier::makeRoom(Shard &shard, u64 len) {
+    while (shard.head + len - shard.tail > capacity) {
+        Entry entry;
+        memcpy(&entry, shard.arena + shard.tail % capacity, sizeof(Entry));
+        // entries of pages that were taken out or stored again since are stale
+        if (entry.pid != ~0ull && entryOf[entry.pid].load(std::memory_order_relaxed) == shard.tail + 1) {
+            entryOf[entry.pid].store(0, std::memory_order_relaxed);
+            drops++;
+        }
+        shard.tail += sizeof(Entry) + (entry.len + sizeof(Entry) - 1) / sizeof(Entry) * sizeof(Entry);
+    }
+}
+
+std::pair<void *, u64> PageIoInterface::prepareWrite(PID pid, PageStore::Location location) {
+    virtMem[pid].tagAndDirty.set_dirty(false);
+    if (store.compression == PageStore::Compression::None) {
+        store.bytesWritten.fetch_add(pageSize, std::memory_order_relaxed);
+        return {virtMem + pid, pageSize};
+    }
+    if (stagingUsed == staging.size())
+        staging.push_back((Page *) aligned_alloc(pageSize, pageSize));
+    u64 previous = store.storedSize(pid);
+    u64 len = store.encode(pid, virtMem + pid, staging[stagingUsed]);
+    if (len == 0) {
+        store.bytesWritten.fetch_add(pageSize, std::memory_order_relaxed);
+        return {virtMem + pid, pageSize};
+    }
+    // the write does not cover the rest of the page
+    if (store.punchTails && len < previous &&
+        fallocate(store.fds[location.device], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, location.offset + len,
+                  pageSize - len)) {
+        std::cerr << "cannot punch hole: " << strerror(errno) << ", disabling PUNCH_HOLE for compressed pages"
+                  << std::endl;
+        store.punchTails = false;
+    }
+    store.bytesWritten.fetch_add(len, std::memory_order_relaxed);
+    return {staging[stagingUsed++], len};
+}
+
+static void checkIoResult(const char *op, PID pid, long ret, long expected) {
+    if (ret != expected) {
+        AIO_ERROR_LOCK.lock();
+        std::cout << "error " << op << " page " << pid << ":" << ret;
+        if (ret < 0)
+            std::cout << ". " << strerror(-ret);
+        std::cout << std::endl;
+        abort();
+    }
+}
+
+void LibaioQueue::init() {
+    memset(&ctx, 0, sizeof(io_context_t));
+    int ret = io_setup(maxIOs, &ctx);
+    if (ret != 0) {
+        std::cerr << "libaio io_setup error: " << ret << " ";
+        switch (-ret) {
+            case EAGAIN:
+                std::cerr << "EAGAIN";
+                break;
+            case EFAULT:
+                std::cerr << "EFAULT";
+                break;
+            case EINVAL:
+                std::cerr << "EINVAL";
+                break;
+            case ENOMEM:
+                std::cerr << "ENOMEM";
+                break;
+            case ENOSYS:
+                std::cerr << "ENOSYS";
+                break;
+        };
+        exit(EXIT_FAILURE);
+    }
+    for (u64 i = 0; i < maxIOs; i++)
+        cbFree[i] = i;
+    cbFreeCount = maxIOs;
+    initialized = true;
+}
+
+void LibaioQueue::prepare(int fd, void *buffer, u64 len, u64 offset, PID pid, bool write) {
+    if (!initialized)
+        init();
+    assert(cbFreeCount > 0);
+    iocb *c = cb + cbFree[--cbFreeCount];
+    if (write)
+        io_prep_pwrite(c, fd, buffer, len, offset);
+    else
+        io_prep_pread(c, fd, buffer, len, offset);
+    c->data = reinterpret_cast<void *>(pid);
+    pending[pendingCount++] = c;
+}
+
+void LibaioQueue::submit() {
+    if (pendingCount == 0)
+        return;
+    int cnt = io_submit(ctx, pendingCount, pending);
+    if (cnt < 0 || u64(cnt) != pendingCount) {
+        AIO_ERROR_LOCK.lock();
+        std::cout << "error submitting io: " << cnt << std::endl;
+        abort();
+    }
+    pendingCount = 0;
+}
+
+u64 LibaioQueue::reap(u64 minCount, u64 maxCount) {
+    timespec timeout{0, 0};
+    int cnt = io_getevents(ctx, minCount, std::min(inFlight(), maxCount), events, minCount ? nullptr : &timeout);
+    if (cnt < 0) {
+        AIO_ERROR_LOCK.lock();
+        std::cout << "error reaping io: " << strerror(-cnt) << std::endl;
+        abort();
+    }
+    for (int i = 0; i < cnt; ++i)
+        cbFree[cbFreeCount++] = events[i].obj - cb;
+    return cnt;
+}
+
+void LibaioInterface::reapWrites(LibaioQueue &queue, u64 minCount) {
+    for (u64 i = 0, cnt = queue.reap(minCount); i < cnt; i++)
+        checkIoResult("writing", reinterpret_cast<PID>(queue.events[i].data), queue.events[i].res,
+                      queue.events[i].obj->u.c.nbytes);
+}
+
+void LibaioInterface::submitWrites(const std::vector<PID> &pages) {
+    for (PID pid: pages) {
+        PageStore::Location location = store.locate(pid);
+        LibaioQueue &queue = writeQueues[location.device];
+        if (queue.initialized && queue.cbFreeCount == 0) {
+            queue.submit();
+            reapWrites(queue, 1);
+        }
+        auto [buffer, len] = prepareWrite(pid, location);
+        queue.prepare(store.fds[location.device], buffer, len, location.offset, pid, true);
+    }
+    for (auto &queue: writeQueues)
+        queue.submit();
+}
+
+void LibaioInterface::completeWrites() {
+    for (auto &queue: writeQueues)
+        while (queue.inFlight() > 0)
+            reapWrites(queue, queue.inFlight());
+    stagingUsed = 0;
+}
+
+void LibaioInterface::readPagesAsync(const std::vector<PID> &pages) {
+    for (PID pid: pages) {
+        PageStore::Location location = store.locate(pid);
+        readQueues[location.device].prepare(store.fds[location.device], virtMem + pid, store.storedSize(pid),
+                                            location.offset, pid, false);
+    }
+    for (auto &queue: readQueues)
+        queue.submit();
+}
+
+u64 LibaioInterface::reapReads(u64 minCount, PID *out) {
+    u64 total = 0;
+    for (bool wait = false;; wait = true) {
+        for (auto &queue: readQueues) {
+            if (queue.inFlight() == 0 || total == maxReap)
+                continue;
+            // block on one device at a time, the others are polled
+            u64 cnt = queue.reap(wait && total < minCount ? 1 : 0, maxReap - total);
+            for (u64 i = 0; i < cnt; ++i) {
+                out[total + i] = reinterpret_cast<PID>(queue.events[i].data);
+                checkIoResult("reading", out[total + i], queue.events[i].res, queue.events[i].obj->u.c.nbytes);
+            }
+            total += cnt;
+        }
+        bool inFlight = std::any_of(readQueues.begin(), readQueues.end(), [](auto &q) { return q.inFlight() > 0; });
+        if (total >= minCount || !inFlight)
+            return total;
+    }
+}
+
+u32 UringInterface::depth = 256;
+bool UringInterface::sqpoll = false;
+bool UringInterface::iopoll = false;
+int UringInterface::sqpollOwnerFd = -1;
+
+int UringInterface::setupRing(PageStore &store, u32 depth, io_uring_params *params) {
+    memset(params, 0, sizeof(io_uring_params));
+    if (iopoll)
+        params->flags |= IORING_SETUP_IOPOLL;
+    if (sqpoll) {
+        params->flags |= IORING_SETUP_SQPOLL;
+        params->sq_thread_idle = 100;
+        if (sqpollOwnerFd >= 0) {
+            params->flags |= IORING_SETUP_ATTACH_WQ;
+            params->wq_fd = sqpollOwnerFd;
+        }
+    }
+    int fd = syscall(SYS_io_uring_setup, depth, params);
+    if (fd < 0)
+        return -1;
+    if (syscall(SYS_io_uring_register, fd, IORING_REGISTER_FILES, store.fds.data(), store.fds.size()) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool UringInterface::probe(PageStore &store) {
+    io_uring_params params;
+    int fd = setupRing(store, 4, &params);
+    if (fd < 0)
+        return false;
+    if (sqpoll)
+        sqpollOwnerFd = fd; // keep open, other rings share its poll thread
+    else
+        close(fd);
+    return true;
+}
+
+void UringInterface::init() {
+    io_uring_params p;
+    ringfd = setupRing(store, depth, &p);
+    if (ringfd < 0)
+        die("io_uring_setup");
+    entries = p.sq_entries;
+    u64 sqSize = p.sq_off.array + p.sq_entries * sizeof(u32);
+    u64 cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sqSize = cqSize = std::max(sqSize, cqSize);
+    u8 *sq = (u8 *) mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd,
+                         IORING_OFF_SQ_RING);
+    u8 *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+        cq = (u8 *) mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd,
+                         IORING_OFF_CQ_RING);
+    sqes = (io_uring_sqe *) mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+        die("io_uring mmap");
+    sqHead = (u32 *) (sq + p.sq_off.head);
+    sqTail = (u32 *) (sq + p.sq_off.tail);
+    sqMask = (u32 *) (sq + p.sq_off.ring_mask);
+    sqFlags = (u32 *) (sq + p.sq_off.flags);
+    sqArray = (u32 *) (sq + p.sq_off.array);
+    cqHead = (u32 *) (cq + p.cq_off.head);
+    cqTail = (u32 *) (cq + p.cq_off.tail);
+    cqMask = (u32 *) (cq + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe *) (cq + p.cq_off.cqes);
+}
+
+UringInterface::~UringInterface() {
+    if (ringfd >= 0)
+        close(ringfd);
+}
+
+void UringInterface::push(PID pid, bool write, void *buffer, u64 len) {
+    if (ringfd < 0)
+        init();
+    // never more requests in flight than the ring has entries, so the completion queue cannot overflow
+    while (writesInFlight + readsInFlight >= entries)
+        reap(1);
+    u32 tail = *sqTail;
+    u32 index = tail & *sqMask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    PageStore::Location location = store.locate(pid);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = location.device; // index into the registered files
+    sqe->addr = reinterpret_cast<u64>(buffer);
+    sqe->len = len;
+    sqe->off = location.offset;
+    sqe->user_data = (pid << 1) | write;
+    sqArray[index] = index;
+    std::atomic_ref<u32>(*sqTail).store(tail + 1, std::memory_order_release);
+    toSubmit++;
+    if (write)
+        writesInFlight++;
+    else
+        readsInFlight++;
+}
+
+void UringInterface::submit(u32 minComplete) {
+    u32 flags = minComplete ? IORING_ENTER_GETEVENTS : 0;
+    u32 submitCount = toSubmit;
+    if (sqpoll) {
+        // the kernel thread picks up new entries by itself unless it went to sleep
+        submitCount = 0;
+        if (std::atomic_ref<u32>(*sqFlags).load(std::memory_order_acquire) & IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        toSubmit = 0;
+    }
+    // with IOPOLL the completions must be polled for actively
+    if (iopoll && !minComplete && (writesInFlight + readsInFlight > 0))
+        flags |= IORING_ENTER_GETEVENTS;
+    if (submitCount == 0 && flags == 0)
+        return;
+    int ret = syscall(SYS_io_uring_enter, ringfd, submitCount, minComplete, flags, nullptr, 0);
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EBUSY || errno == EINTR)
+            return;
+        AIO_ERROR_LOCK.lock();
+        std::cout << "io_uring_enter error: " << strerror(errno) << std::endl;
+        abort();
+    }
+    if (!sqpoll)
+        toSubmit -= ret;
+}
+
+// process completions, waits for at least minComplete of them
+void UringInterface::reap(u32 minComplete) {
+    if (toSubmit || iopoll)
+        submit(0);
+    for (u32 reaped = 0;;) {
+        u32 head = *cqHead;
+        u32 tail = std::atomic_ref<u32>(*cqTail).load(std::memory_order_acquire);
+        for (; head != tail; head++, reaped++) {
+            io_uring_cqe *cqe = &cqes[head & *cqMask];
+            PID pid = cqe->user_data >> 1;
+            // the page is still locked, so its stored size has not changed since the request was pushed
+            if (cqe->user_data & 1) {
+                checkIoResult("writing", pid, cqe->res, store.storedSize(pid));
+                writesInFlight--;
+            } else {
+                checkIoResult("reading", pid, cqe->res, store.storedSize(pid));
+                readsInFlight--;
+                completedReads.push_back(pid);
+            }
+        }
+        std::atomic_ref<u32>(*cqHead).store(head, std::memory_order_release);
+        if (reaped >= minComplete)
+            return;
+        submit(1);
+    }
+}
+
+void UringInterface::submitWrites(const std::vector<PID> &pages) {
+    for (PID pid: pages) {
+        auto [buffer, len] = prepareWrite(pid, store.locate(pid));
+        push(pid, true, buffer, len);
+    }
+    submit(0);
+}
+
+void UringInterface::completeWrites() {
+    while (writesInFlight > 0)
+        reap(1);
+    stagingUsed = 0;
+}
+
+void UringInterface::readPagesAsync(const std::vector<PID> &pages) {
+    for (PID pid: pages)
+        push(pid, false, virtMem + pid, store.storedSize(pid));
+    submit(0);
+}
+
+u64 UringInterface::reapReads(u64 minCount, PID *out) {
+    if (ringfd < 0)
+        return 0;
+    if (completedReads.size() < minCount && readsInFlight > 0)
+        reap(1);
+    else
+        reap(0);
+    u64 cnt = std::min<u64>(completedReads.size(), maxReap);
+    std::copy(completedReads.end() - cnt, completedReads.end(), out);
+    completedReads.resize(completedReads.size() - cnt);
+    return cnt;
 }
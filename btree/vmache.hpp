@@ -3,25 +3,36 @@
 #include <atomic>
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <csignal>
+#include <deque>
 #include <exception>
 #include <fcntl.h>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <mutex>
 #include <numeric>
 #include <set>
 #include <thread>
+#include <unordered_set>
 #include <vector>
 #include <span>
+#include <string>
 
 #include <errno.h>
 #include <libaio.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <immintrin.h>
 #include "config.hpp"
@@ -46,6 +57,40 @@ struct alignas(pageSize) Page {
 };
 
 static const int16_t maxWorkerThreads = 257;
+static const int16_t maxEvictionThreads = 64;
+
+// the disk slot of this pid holds the superblock, it is never allocated
+static const u64 superblockPid = 1;
+
+// the pinned region for inner nodes starts after the superblock, see BufferManager::allocPinnedPage
+static const u64 firstPinnedPid = superblockPid + 1;
+
+// written by BufferManager::sync, allows reopening the block device with REOPEN=1
+struct Superblock {
+    static const u64 magicValue = 0x3432656572744276; // "vBtree24"
+    static const u64 maxTrees = 64;
+
+    u64 magic;
+    u64 pageSize;
+    u64 allocCount;
+    u64 treeCount;
+    u64 pinnedCount;
+    u64 pinnedNext;
+    // striping the pages were written with, stripeExtent is 0 for interleave
+    u64 deviceCount;
+    u64 stripeExtent;
+    // size of the fast tier, its slot map is stored after the slots, see PageStore::writeFastMap
+    u64 fastSlots;
+    // Incremented by every sync. The checkpoints are fuzzy: pages are written while splits and merges go on, so the
+    // pages of one checkpoint need not form a consistent tree unless the sync ran without concurrent modifications.
+    u64 fuzzyCheckpoints;
+    // modifications with smaller log sequence numbers are contained in the checkpoint, see WriteAheadLog
+    u64 checkpointLsn;
+    // first page of the persisted free list, 0 if there is none, see BufferManager::writeFreeList
+    PID freeListHead;
+    // for each tree a page from which it can find its data, see BufferManager::registerTree
+    PID treeAnchors[maxTrees];
+};
 
 #define die(msg) do { perror(msg); exit(EXIT_FAILURE); } while(0)
 
@@ -54,8 +99,52 @@ void *allocHuge(size_t size);
 
 void setVmcacheWorkerThreadId(uint16_t);
 
+struct NumaNode {
+    unsigned id;
+    std::vector<unsigned> cpus;
+};
+
+// online numa nodes that have cpus, read from sysfs. Empty if the topology is unavailable.
+std::vector<NumaNode> numaNodesWithCpus();
+
+// set a memory policy for a range of whole pages, returns false on failure
+bool numaBind(void *addr, u64 len, int mode, const std::vector<unsigned> &nodes, bool move);
+
+// index of this thread's io interface and per-thread state, set by setVmcacheWorkerThreadId
+extern __thread uint16_t workerThreadId;
+
+// number of prefetch reads issued by this thread that have not been completed yet
+extern __thread u64 asyncReadsInFlight;
+
+// tree + 1 of the operation this thread executes, 0 outside of tree operations, see TreeScope
+extern __thread uint16_t currentTree;
+
+// page accesses of this thread since the innermost TreeScope was entered
+extern __thread u64 currentTreeAccesses;
+
+// set while an AsyncScheduler runs operations on this thread, faults of optimistic reads throw PageFaultSuspend
+extern __thread bool suspendFaults;
+
+// Pages allocated and freed by the structure modification this thread runs, collected while a
+// WriteAheadLog::StructureScope is open. Allocated pages stay locked and freed pids stay off the free lists until the
+// scope has logged them.
+struct StructureChange {
+    std::vector<PID> allocated;
+    // allocated pages the structure modification released, their unlock is deferred
+    std::vector<PID> released;
+    std::vector<PID> freed;
+};
+
+extern __thread StructureChange *structureChange;
+
+// complete finished prefetch reads of this thread
+void reapAsyncReads();
+
 // use when lock is not free
 inline void vmcache_yield(u64 counter = 0) {
+    // the lock may be held by one of our own prefetch reads
+    if (asyncReadsInFlight)
+        reapAsyncReads();
     _mm_pause();
 }
 
@@ -68,6 +157,14 @@ struct PageState {
     static const u64 Marked = 254;
     static const u64 Evicted = 255;
 
+    // Threads waiting for an exclusively locked page spin with exponential backoff for spinRounds rounds, then park
+    // on the futex in the upper half of the state word, which contains the state. Parking is enabled by LOCK_PARK.
+    static const u64 spinRounds = 8;
+    static const u64 parkBuckets = 1024;
+    static bool parking;
+    // number of threads parked per bucket, unlocking only issues a wake-up system call if there are any
+    static std::atomic<u32> parkedWaiters[parkBuckets];
+
     PageState() {}
 
     void init();
@@ -89,12 +186,14 @@ struct PageState {
         NOSYNC_RET();
         assert(getState() == Locked);
         stateAndVersion.store(nextVersion(stateAndVersion.load(), Unlocked), std::memory_order_release);
+        wakeParked();
     }
 
     void unlockXEvicted() {
         NOSYNC_ABORT;
         assert(getState() == Locked);
         stateAndVersion.store(nextVersion(stateAndVersion.load(), Evicted), std::memory_order_release);
+        wakeParked();
     }
 
     u64 downgradeXtoO() {
@@ -102,9 +201,32 @@ struct PageState {
         auto next = nextVersion(stateAndVersion.load(), Unlocked);
         assert(getState() == Locked);
         stateAndVersion.store(next, std::memory_order_release);
+        wakeParked();
         return next;
     }
 
+    std::atomic<u32> &parkBucket() {
+        return parkedWaiters[(reinterpret_cast<uintptr_t>(this) / sizeof(PageState)) % parkBuckets];
+    }
+
+    // futexes are 32 bit, wait on the upper half of the little endian state word
+    u32 *futexWord() { return reinterpret_cast<u32 *>(&stateAndVersion) + 1; }
+
+    void wakeParked() {
+        if (!parking)
+            return;
+        // pairs with the increment in park: either the waiter sees the new state or we see the waiter
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parkBucket().load(std::memory_order_relaxed))
+            syscall(SYS_futex, futexWord(), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+    }
+
+    // sleep until the state word no longer equals observed, for at most 1ms
+    void park(u64 observed);
+
+    // Back off after failing to lock the page in state observed. repeatCounter counts the failed attempts.
+    void wait(u64 observed, u64 repeatCounter);
+
     bool tryLockS(u64 oldStateAndVersion) {
         NOSYNC_RET(true);
         u64 s = getState(oldStateAndVersion);
@@ -147,25 +269,33 @@ struct PageState {
     void operator=(PageState &) = delete;
 };
 
-// open addressing hash table used for second chance replacement to keep track of currently-cached pages
+// open addressing hash table used for second chance replacement to keep track of currently-cached pages.
+// Pids are partitioned into shards by hash, each shard has its own table and clock hand.
 struct ResidentPageSet {
     static const u64 empty = ~0ull;
     static const u64 tombstone = (~0ull) - 1;
+    static const u64 maxShards = 64;
 
     struct Entry {
         std::atomic<u64> pid;
     };
 
-    Entry *ht;
-    u64 count;
-    u64 mask;
-    std::atomic<u64> clockPos;
+    struct alignas(64) Shard {
+        Entry *ht;
+        u64 count;
+        u64 mask;
+        std::atomic<u64> clockPos;
+    };
 
-    ResidentPageSet(u64 maxCount);
+    Shard *shards;
+    u64 shardCount;
 
-    ~ResidentPageSet() {
-        munmap(ht, count * sizeof(u64));
-    }
+    ResidentPageSet(u64 maxCount, u64 shardCount);
+
+    ~ResidentPageSet();
+
+    // place the tables of the shards round robin on the given nodes
+    void placeShards(const std::vector<unsigned> &nodes);
 
     u64 next_pow2(u64 x) {
         return 1 << (64 - __builtin_clzl(x - 1));
@@ -186,116 +316,613 @@ struct ResidentPageSet {
         return h;
     }
 
+    // the high bits select the shard, the low bits the slot within it
+    Shard &shardFor(u64 h) { return shards[(h >> 58) & (shardCount - 1)]; }
+
     void insert(u64 pid) {
-        u64 pos = hash(pid) & mask;
-        while (true) {
-            u64 curr = ht[pos].pid.load();
+        u64 h = hash(pid);
+        Shard &shard = shardFor(h);
+        u64 pos = h & shard.mask;
+        for (u64 probes = 0; probes <= shard.mask; probes++) {
+            u64 curr = shard.ht[pos].pid.load();
             assert(curr != pid);
             if ((curr == empty) || (curr == tombstone))
-                if (ht[pos].pid.compare_exchange_strong(curr, pid))
+                if (shard.ht[pos].pid.compare_exchange_strong(curr, pid))
                     return;
 
-            pos = (pos + 1) & mask;
+            pos = (pos + 1) & shard.mask;
         }
+        // the pids of one shard exceeded its share of the resident pages, probing would spin forever
+        std::cerr << "resident page set shard is full, use fewer RESIDENT_SHARDS" << std::endl;
+        abort();
     }
 
     bool remove(u64 pid) {
-        u64 pos = hash(pid) & mask;
-        while (true) {
-            u64 curr = ht[pos].pid.load();
+        u64 h = hash(pid);
+        Shard &shard = shardFor(h);
+        u64 pos = h & shard.mask;
+        for (u64 probes = 0; probes <= shard.mask; probes++) {
+            u64 curr = shard.ht[pos].pid.load();
             if (curr == empty)
                 return false;
 
             if (curr == pid)
-                if (ht[pos].pid.compare_exchange_strong(curr, tombstone))
+                if (shard.ht[pos].pid.compare_exchange_strong(curr, tombstone))
                     return true;
 
-            pos = (pos + 1) & mask;
+            pos = (pos + 1) & shard.mask;
         }
+        return false;
     }
 
     template<class Fn>
     void iterateClockBatch(u64 batch, Fn fn) {
+        // every thread sweeps the shards round robin, starting at a different one
+        static thread_local u64 shardCursor = workerThreadId;
+        Shard &shard = shards[shardCursor++ & (shardCount - 1)];
         u64 pos, newPos;
         do {
-            pos = clockPos.load();
-            newPos = (pos + batch) % count;
-        } while (!clockPos.compare_exchange_strong(pos, newPos));
+            pos = shard.clockPos.load();
+            newPos = (pos + batch) & shard.mask;
+        } while (!shard.clockPos.compare_exchange_strong(pos, newPos));
 
         for (u64 i = 0; i < batch; i++) {
-            u64 curr = ht[pos].pid.load();
+            u64 curr = shard.ht[pos].pid.load();
             if ((curr != tombstone) && (curr != empty))
                 fn(curr);
-            pos = (pos + 1) & mask;
+            pos = (pos + 1) & shard.mask;
         }
     }
+
+    template<class Fn>
+    void forEach(Fn fn) {
+        for (u64 s = 0; s < shardCount; s++)
+            for (u64 i = 0; i < shards[s].count; i++) {
+                u64 curr = shards[s].ht[i].pid.load();
+                if ((curr != tombstone) && (curr != empty))
+                    fn(curr);
+            }
+    }
 };
 
-// libaio interface used to write batches of pages
-struct LibaioInterface {
-    static const u64 maxIOs = 64;
+// Counter striped over cache lines by worker thread id. Each stripe folds its delta into the total once it exceeds
+// foldThreshold, so load() is cheap but may be off by up to stripes * foldThreshold.
+struct ApproximateCounter {
+    static const u64 stripes = 64;
+    static const int64_t foldThreshold = 64;
+
+    struct alignas(64) Stripe {
+        std::atomic<int64_t> delta;
+    };
+
+    Stripe stripe[stripes];
+    std::atomic<int64_t> total;
+
+    ApproximateCounter() : total(0) {
+        for (auto &s: stripe)
+            s.delta = 0;
+    }
 
-    int blockfd;
+    void add(int64_t n) {
+        Stripe &s = stripe[workerThreadId % stripes];
+        int64_t d = s.delta.fetch_add(n, std::memory_order_relaxed) + n;
+        if (d >= foldThreshold || d <= -foldThreshold)
+            total.fetch_add(s.delta.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    u64 load() {
+        int64_t t = total.load(std::memory_order_relaxed);
+        return t < 0 ? 0 : t;
+    }
+
+    u64 loadExact() {
+        int64_t t = total.load();
+        for (auto &s: stripe)
+            t += s.delta.load();
+        return t < 0 ? 0 : t;
+    }
+};
+
+// Pages and accesses of one tree. Pages are attributed to the tree whose operation allocated them, or after a restart
+// to the one that faulted them in first. The counts are approximate.
+struct TreeFrames {
+    ApproximateCounter resident;
+    ApproximateCounter accesses;
+    ApproximateCounter misses;
+    ApproximateCounter evictions;
+    // resident pages above which the pages of the tree are evicted first, 0 if unlimited (TREE_QUOTA_MB)
+    std::atomic<u64> quota{0};
+    // additional clock rotations the unaccessed pages of the tree stay resident (TREE_PRIORITY)
+    std::atomic<u8> priority{0};
+
+    bool overQuota() {
+        u64 q = quota.load(std::memory_order_relaxed);
+        return q && resident.load() > q;
+    }
+};
+
+// Byte range of a page that holds no data, such as the free space between the slots and the heap of a node.
+// Compression does not store it, so its contents are undefined after the page is read back.
+struct PageGap {
+    u32 begin;
+    u32 end;
+};
+
+// The devices or files pages are stored on. BLOCK is a comma separated list of paths, with more than one pages are
+// striped over them, see locate.
+// FAST_BLOCK adds a fast tier of FAST_MB in front of them, it is the last entry of fds. Eviction moves pages that are
+// faulted in often to a slot on it and pages that stay evicted back to the striped devices, see BufferManager::promote.
+struct PageStore {
+    enum class Striping { Interleave, Extent };
+    enum class Compression { None, Gap, Lz4 };
+
+    // Compressed pages are stored as a header followed by the data, padded to whole sectors. The first byte of a
+    // node is a tag or a dirty flag, neither can be compressedMagic, so reads recognize compressed pages by it.
+    static const u8 compressedMagic = 0x7f;
+    static const u64 sectorSize = 512;
+
+    struct CompressedHeader {
+        u8 magic;
+        u8 lz4;
+        u16 padding;
+        // the bytes before and after the gap, and their size after compression
+        u32 headLen;
+        u32 tailLen;
+        u32 dataLen;
+    };
+
+    struct Location {
+        u32 device;
+        u64 offset;
+    };
+
+    std::vector<int> fds;
+    std::vector<std::string> paths;
+    Striping striping = Striping::Interleave;
+    // consecutive pids placed on the same device with extent striping
+    u64 extentPages = 1;
+    // number of striped devices, the fast tier is not counted
+    u64 stripeCount = 0;
+
+    // fast tier, disabled if fastSlots is 0
+    u32 fastDevice = 0;
+    u64 fastSlots = 0;
+    // per pid: fast slot + 1, or 0 if the page is on the striped devices. Only changed while the page is locked.
+    std::atomic<u32> *slotOf = nullptr;
+    // per pid: saturating number of faults since the page was last moved off the fast tier
+    std::atomic<u8> *faultCount = nullptr;
+    // per slot: faulted in from the slot since the clock hand last passed it
+    std::unique_ptr<std::atomic<u8>[]> referenced;
+    // per slot: the pid stored in it or 0 if it is free, pid 0 is never evicted. Protected by tierMutex, like the
+    // free slots and the hand.
+    std::vector<PID> pidOf;
+    std::vector<u64> freeSlots;
+    u64 hand = 0;
+    std::mutex tierMutex;
+
+    // COMPRESS, none, gap or lz4. With gap, pages are written without their gap, lz4 also compresses the rest.
+    Compression compression = Compression::None;
+    // set by the data structure, returns an empty range for pages without a gap
+    PageGap (*pageGap)(PID pid, Page *page) = nullptr;
+    // per pid: sectors the page was last written with, or 0 if it is unknown or uncompressed, then the whole page is
+    // read. Not persisted, after reopening the first read of every page is a whole page.
+    std::atomic<u8> *storedSectors = nullptr;
+    // release the unused end of compressed pages (PUNCH_HOLE)
+    bool punchTails = false;
+    // bytes written by page writes
+    std::atomic<u64> bytesWritten{0};
+
+    // open a comma separated list of paths, STRIPE selects interleave or extent striping, STRIPE_EXTENT the extent
+    // size in pages. Also opens the fast tier, if any.
+    void open(const char *pathList, u64 virtCount);
+
+    // number of open devices, including the fast tier
+    u64 deviceCount() { return fds.size(); }
+
+    Location locate(PID pid) {
+        if (fastSlots) {
+            u32 slot = slotOf[pid].load(std::memory_order_relaxed);
+            if (slot)
+                return {fastDevice, (slot - 1) * pageSize};
+        }
+        return locateStriped(pid);
+    }
+
+    // interleave: pid i is on device i % n. extent: runs of extentPages pids are placed on the devices round robin.
+    Location locateStriped(PID pid) {
+        u64 n = stripeCount;
+        if (n == 1)
+            return {0, pid * pageSize};
+        if (striping == Striping::Interleave)
+            return {static_cast<u32>(pid % n), pid / n * pageSize};
+        u64 extent = pid / extentPages;
+        return {static_cast<u32>(extent % n), (extent / n * extentPages + pid % extentPages) * pageSize};
+    }
+
+    bool onFastTier(Location location) { return fastSlots && location.device == fastDevice; }
+
+    void openFastTier(const char *fastPath, u64 virtCount);
+
+    // count a fault of the page, returns true if it was read from the fast tier
+    bool noteFault(PID pid);
+
+    // the page is locked exclusively and freed, give up its slot
+    void releaseFastSlot(PID pid);
+
+    // the slot map is stored after the slots, rounded up to whole pages
+    u64 fastMapPages() { return (fastSlots * sizeof(PID) + pageSize - 1) / pageSize; }
+
+    void writeFastMap();
+
+    // restore the slot map, pids that were not persisted are dropped
+    void readFastMap(u64 allocCount);
+
+    // bytes to read or write for the page, the page must be locked
+    u64 storedSize(PID pid) {
+        u8 sectors = storedSectors ? storedSectors[pid].load(std::memory_order_relaxed) : 0;
+        return sectors ? sectors * sectorSize : pageSize;
+    }
+
+    // Write a header and the page without its gap to out, compressed with lz4 if requested. Returns the size of both,
+    // or 0 if the data would exceed capacity bytes.
+    u64 compressPage(PID pid, Page *page, u8 *out, u64 capacity, bool lz4);
+
+    // Compress a page into out, which must have room for a page. Returns the bytes to write, or 0 if compression
+    // does not save a sector and the page is written as is. Updates storedSectors.
+    u64 encode(PID pid, Page *page, Page *out);
+
+    // decompress a page read into its frame in place, pages that are not compressed are left alone
+    void decode(Page *page) {
+        if (reinterpret_cast<u8 *>(page)[0] == compressedMagic)
+            decodeCompressed(page);
+    }
+
+    void decodeCompressed(Page *page);
+
+    // synchronous io of pages, ranges of pids are split into runs that are contiguous on one device
+    void readPages(PID first, u64 count, Page *dst);
+
+    void writePages(PID first, u64 count, Page *src);
+
+    void syncAll();
+};
+
+// Compressed copies of evicted pages in memory, in front of the page store like zswap (ZTIER_MB). Eviction adds
+// clean pages, faults take them out again instead of reading them. Pids are partitioned into shards, each shard is
+// a ring buffer, once it is full the oldest copies are dropped to make room. The devices hold the same version of
+// every page in the tier, so dropping needs no io.
+struct CompressedTier {
+    // ring buffer entry, followed by the compressed page and padded to a multiple of its size. pid is ~0 for the
+    // padding at the end of the arena.
+    struct Entry {
+        PID pid;
+        u64 len;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        u8 *arena;
+        // positions since the shard was created, the arena holds the entries in [tail, head)
+        u64 head;
+        u64 tail;
+    };
+
+    // bytes per shard, 0 if the tier is disabled
+    u64 capacity = 0;
+    u64 shardCount = 0;
+    std::unique_ptr<Shard[]> shards;
+    u64 virtCount = 0;
+    // per pid: position of the copy of the page + 1, or 0 if it has none. Protected by the mutex of the shard, only
+    // pages that are locked exclusively are added or taken out.
+    std::atomic<u64> *entryOf = nullptr;
+    bool lz4 = false;
+
+    std::atomic<u64> stores{0};
+    std::atomic<u64> hits{0};
+    // copies dropped because the shard was full
+    std::atomic<u64> drops{0};
+
+    ~CompressedTier();
+
+    // ZTIER_MB and ZTIER_SHARDS, pages are compressed with lz4 if the build supports it and only without their gap
+    // otherwise
+    void open(u64 virtCount, u64 defaultShards);
+
+    bool enabled() { return capacity != 0; }
+
+    Shard &shardFor(PID pid) { return shards[pid & (shardCount - 1)]; }
+
+    // store a copy of a clean page, which is locked exclusively and about to be evicted
+    void insert(PID pid, Page *page, PageStore &store);
+
+    // Copy the page into its frame and drop the copy, the page is locked exclusively. Returns false if the tier has
+    // no copy of it.
+    bool take(PID pid, Page *frame, PageStore &store);
+
+    // drop entries at the tail until there is room for len bytes, the mutex of the shard is held
+    void makeRoom(Shard &shard, u64 len);
+};
+
+// reads and writes batches of pages, every thread uses its own instance
+struct PageIoInterface {
+    // upper bound for completions returned by one reapReads call
+    static const u64 maxReap = 64;
+
+    PageStore &store;
     Page *virtMem;
+
+    // buffers for compressed pages, the first stagingUsed hold writes that have not been completed yet
+    std::vector<Page *> staging;
+    u64 stagingUsed = 0;
+
+    PageIoInterface(PageStore &store, Page *virtMem) : store(store), virtMem(virtMem) {}
+
+    virtual ~PageIoInterface() {
+        for (Page *buffer: staging)
+            free(buffer);
+    }
+
+    // Clear the dirty flag of a page about to be written and compress it if enabled.
+    // Returns the buffer to write and its length, it stays valid until completeWrites.
+    std::pair<void *, u64> prepareWrite(PID pid, PageStore::Location location);
+
+    // start writing pages, clears their dirty flag. Pages must stay locked until completeWrites returns.
+    virtual void submitWrites(const std::vector<PID> &pages) = 0;
+
+    // wait for all writes submitted so far
+    virtual void completeWrites() = 0;
+
+    void writePages(const std::vector<PID> &pages) {
+        submitWrites(pages);
+        completeWrites();
+    }
+
+    virtual u64 readSlotsAvailable() = 0;
+
+    // pages must be locked exclusively, at most readSlotsAvailable() pages
+    virtual void readPagesAsync(const std::vector<PID> &pages) = 0;
+
+    // stores pids of completed reads in out (at most maxReap), waits for at least minCount completions
+    virtual u64 reapReads(u64 minCount, PID *out) = 0;
+};
+
+// one libaio context and a fixed number of iocbs, set up on first use
+struct LibaioQueue {
+    static const u64 maxIOs = 64;
+
     io_context_t ctx;
+    bool initialized = false;
     iocb cb[maxIOs];
-    iocb *cbPtr[maxIOs];
+    u16 cbFree[maxIOs];
+    u64 cbFreeCount = maxIOs;
+    iocb *pending[maxIOs];
+    u64 pendingCount = 0;
     io_event events[maxIOs];
 
-    LibaioInterface(int blockfd, Page *virtMem) : blockfd(blockfd), virtMem(virtMem) {
-        memset(&ctx, 0, sizeof(io_context_t));
-        int ret = io_setup(maxIOs, &ctx);
-        if (ret != 0) {
-            std::cerr << "libaio io_setup error: " << ret << " ";
-            switch (-ret) {
-                case EAGAIN:
-                    std::cerr << "EAGAIN";
-                    break;
-                case EFAULT:
-                    std::cerr << "EFAULT";
-                    break;
-                case EINVAL:
-                    std::cerr << "EINVAL";
-                    break;
-                case ENOMEM:
-                    std::cerr << "ENOMEM";
-                    break;
-                case ENOSYS:
-                    std::cerr << "ENOSYS";
-                    break;
-            };
-            exit(EXIT_FAILURE);
-        }
+    void init();
+
+    u64 inFlight() { return maxIOs - cbFreeCount; }
+
+    // queue a request, at most cbFreeCount
+    void prepare(int fd, void *buffer, u64 len, u64 offset, PID pid, bool write);
+
+    // submit the prepared requests
+    void submit();
+
+    // returns number of completions stored in events (at most maxCount), their iocbs are free again
+    u64 reap(u64 minCount, u64 maxCount = maxIOs);
+};
+
+// libaio interface with one read and one write context per device. Reads and writes use separate contexts, so
+// completeWrites does not consume read completions.
+struct LibaioInterface : PageIoInterface {
+    std::vector<LibaioQueue> writeQueues;
+    std::vector<LibaioQueue> readQueues;
+
+    LibaioInterface(PageStore &store, Page *virtMem) : PageIoInterface(store, virtMem),
+                                                       writeQueues(store.deviceCount()),
+                                                       readQueues(store.deviceCount()) {}
+
+    // reap completed writes of a device, waiting for at least minCount
+    void reapWrites(LibaioQueue &queue, u64 minCount);
+
+    void submitWrites(const std::vector<PID> &pages) override;
+
+    void completeWrites() override;
+
+    // the prefetched pages may all be on the same device
+    u64 readSlotsAvailable() override {
+        u64 slots = LibaioQueue::maxIOs;
+        for (auto &q: readQueues)
+            slots = std::min(slots, q.cbFreeCount);
+        return slots;
     }
 
-    void writePages(const std::vector<PID> &pages);
+    void readPagesAsync(const std::vector<PID> &pages) override;
+
+    u64 reapReads(u64 minCount, PID *out) override;
 };
 
+// io_uring interface using the raw system calls. The devices are registered as fixed files, one ring serves all of them.
+// virtMem is not registered as fixed buffer: registration pins the frames, which breaks MADV_DONTNEED eviction.
+struct UringInterface : PageIoInterface {
+    static u32 depth;
+    static bool sqpoll;
+    static bool iopoll;
+    // ring whose SQPOLL thread is shared by all rings
+    static int sqpollOwnerFd;
+
+    int ringfd = -1;
+    u32 entries;
+    u32 *sqHead;
+    u32 *sqTail;
+    u32 *sqMask;
+    u32 *sqFlags;
+    u32 *sqArray;
+    struct io_uring_sqe *sqes;
+    u32 *cqHead;
+    u32 *cqTail;
+    u32 *cqMask;
+    struct io_uring_cqe *cqes;
+    u32 toSubmit = 0;
+    u64 writesInFlight = 0;
+    u64 readsInFlight = 0;
+    std::vector<PID> completedReads;
+
+    UringInterface(PageStore &store, Page *virtMem) : PageIoInterface(store, virtMem) {}
+
+    ~UringInterface() override;
+
+    // try to set up a ring with the configured flags, returns false if io_uring is not usable
+    static bool probe(PageStore &store);
+
+    static int setupRing(PageStore &store, u32 depth, struct io_uring_params *params);
+
+    void init();
+
+    void push(PID pid, bool write, void *buffer, u64 len);
+
+    void submit(u32 minComplete);
+
+    void reap(u32 minComplete);
+
+    void submitWrites(const std::vector<PID> &pages) override;
+
+    void completeWrites() override;
+
+    // reads may take at most half the ring, so writes always make progress
+    u64 readSlotsAvailable() override { return (ringfd < 0 ? depth : entries) / 2 - readsInFlight; }
+
+    void readPagesAsync(const std::vector<PID> &pages) override;
+
+    u64 reapReads(u64 minCount, PID *out) override;
+};
+
+struct ReplacementPolicy;
+
+struct PidChunk;
+
 struct BufferManager {
     static const u64 mb = 1024ull * 1024;
     static const u64 gb = 1024ull * 1024 * 1024;
     u64 virtSize;
-    u64 physSize;
+    // changed by resize
+    std::atomic<u64> physSize;
     u64 virtCount;
-    u64 physCount;
+    std::atomic<u64> physCount;
+    // upper bound for resize, the resident set is sized for it so it never has to grow (PHYSGB_MAX)
+    u64 physCountMax;
+    // Frames foreground threads evict at. Equal to physCount, except while eviction threads shrink the pool after a
+    // resize, then it follows the number of used frames down, see lowerForegroundCount.
+    std::atomic<u64> foregroundCount;
     struct exmap_user_interface *exmapInterface[maxWorkerThreads];
-    std::vector<LibaioInterface> libaioInterface;
+    std::vector<std::unique_ptr<PageIoInterface>> ioInterface;
 
     bool useExmap;
-    int blockfd;
+    PageStore store;
+    CompressedTier compressedTier;
     int exmapfd;
+    // number of numa nodes memory is placed on, 1 if placement is disabled
+    unsigned numaNodeCount;
+    // unmap eviction batches with one process_madvise call
+    bool useProcessMadvise;
+    int pidfd;
 
-    std::atomic<u64> physUsedCount;
+    ApproximateCounter physUsedCount;
     ResidentPageSet residentSet;
+    // chooses eviction candidates among the pages the clock passes, see EVICT_POLICY
+    std::unique_ptr<ReplacementPolicy> policy;
     std::atomic<u64> allocCount;
 
+    // Pinned region of pinnedCount pages starting at firstPinnedPid. Its pages are never evicted, are not in the
+    // resident set and are not counted in physUsedCount, they have their own budget (PINNEDMB).
+    u64 pinnedCount;
+    std::atomic<u64> pinnedNext;
+    std::atomic<u64> pinnedUsed;
+    // pinned allocations served from the evictable pool because the region was full
+    std::atomic<u64> pinnedFallbacks;
+    // freed pinned pids, protected by freeListMutex
+    std::vector<PID> pinnedFreeList;
+
+    // per pid: tree + 1 the page is attributed to, or 0
+    std::atomic<u8> *pageOwner;
+    // per pid: rotations the page stayed marked because of the priority of its tree
+    std::atomic<u8> *pageChances;
+    // per pid: lsn of the last log record that changed the page, it is only written once that record is durable
+    std::atomic<u64> *pageLsn;
+    TreeFrames treeFrames[Superblock::maxTrees];
+
+    // freed pids, reused by allocPage
+    std::mutex freeListMutex;
+    std::vector<PID> freeList;
+    std::atomic<u64> freeListSize;
+    // release the backing storage of freed pages
+    bool punchHoles;
+    // number of pids a thread reserves from allocCount at once, unused ones are put on the free list on thread exit
+    u64 allocChunk;
+    // the chunks of all threads, sync moves their unused pids to the free list
+    std::mutex pidChunkMutex;
+    std::vector<PidChunk *> pidChunks;
+    // pages the free list of the last checkpoint is stored in, reserved until the next checkpoint replaces them
+    std::vector<PID> freeListPages;
+    // between beginRedo and endRedo: the pids of both free lists and freeListPages, looked up per replayed page
+    bool redoing;
+    std::unordered_set<PID> redoFreePids;
+    std::unordered_set<PID> redoReservedPids;
+
     std::atomic<u64> readCount;
     std::atomic<u64> writeCount;
 
+    // evicted pages faulted in at least promoteFaults times are moved to the fast tier (FAST_FAULTS)
+    u64 promoteFaults;
+    std::atomic<u64> promotions;
+    std::atomic<u64> demotions;
+    // background thread moving the pages the clock hand took a fast slot from back to the striped devices, the pages
+    // stay locked exclusively until then
+    std::thread demotionThread;
+    std::mutex demotionMutex;
+    std::condition_variable demotionWakeup;
+    std::deque<std::pair<PID, u64>> demotionQueue;
+    bool demotionStop;
+    std::atomic<u64> fastReads;
+    // faults that suspended an operation instead of blocking the thread, see faultAsync
+    std::atomic<u64> suspendedFaults;
+    // added to synchronous reads from the striped devices, emulates a slow device for testing (SLOW_LATENCY_US)
+    u64 slowReadLatency;
+
+    // state restored from the block device on REOPEN, or written by sync
+    Superblock superblock;
+    std::mutex syncMutex;
+    std::atomic<u64> treeCount;
+    bool reopened;
+    // sync on destruction
+    bool persist;
+
+    // background thread calling sync every checkpointInterval seconds, at most checkpointBandwidth bytes/s
+    u64 checkpointInterval;
+    u64 checkpointBandwidth;
+    std::thread checkpointThread;
+    std::mutex checkpointMutex;
+    std::condition_variable checkpointWakeup;
+    bool checkpointStop;
+
     Page *virtMem;
     PageState *pageState;
     u64 batch;
 
+    // background eviction keeps between freeLow and freeHigh frames free, foreground threads only evict below 5%
+    std::atomic<u64> freeLow;
+    std::atomic<u64> freeHigh;
+    // EVICT_FREE_LOW and EVICT_FREE_HIGH, the watermarks in percent of physCount
+    u64 freeLowPercent;
+    u64 freeHighPercent;
+    // serializes resize calls
+    std::mutex resizeMutex;
+    std::vector<std::thread> evictionThreads;
+    std::atomic<u64> evictionWakeup;
+    std::atomic<u64> evictionSleeping;
+    std::atomic<bool> evictionStop;
+
     PageState &getPageState(PID pid) {
         return pageState[pid];
     }
@@ -309,7 +936,7 @@ struct BufferManager {
         return hash;
     }
 
-    ~BufferManager() {}
+    ~BufferManager();
 
     Page *fixX(PID pid);
 
@@ -329,11 +956,130 @@ struct BufferManager {
 
     Page *allocPage();
 
+    // allocate a page that is never evicted, for inner nodes and metadata. Falls back to allocPage if the region is full.
+    Page *allocPinnedPage();
+
+    bool isPinned(PID pid) { return pid - firstPinnedPid < pinnedCount; }
+
+    // Free an exclusively locked page, the lock is released.
+    // Optimistic readers of the page fail validation because the version changes.
+    void freePage(PID pid);
+
+    // put never allocated pids on the free list
+    void returnPids(PID begin, PID end);
+
+    // put a pid freed under a StructureScope on its free list
+    void releasePid(PID pid);
+
+    // Index the free lists for redoPage and redoFree, endRedo puts them back. Checkpoints wait in between, they
+    // would persist the free lists.
+    void beginRedo();
+
+    void endRedo();
+
+    // Lock a page for restoring its image from the log, without reading it. Takes the pid off the free lists and
+    // extends allocCount or the pinned region as needed. Only between beginRedo and endRedo.
+    Page *redoPage(PID pid);
+
+    // free a page again whose release was logged
+    void redoFree(PID pid);
+
     void handleFault(PID pid);
 
     void readPage(PID pid);
 
+    // Start reading evicted pages without blocking. Pages that are not evicted or cannot be locked are skipped.
+    // Reads are completed by the calling thread, either while it waits for a lock or in pollReads.
+    // All reads must be completed before the thread exits.
+    void prefetch(std::span<PID> pids);
+
+    // complete prefetch reads of the calling thread, if wait is set wait for one of them, or all of them with all
+    void pollReads(bool wait, bool all = true);
+
+    // Start reading an evicted page the caller wants to access. Returns true if the read was submitted (or someone
+    // else holds the page locked) and the caller should retry once the page is unlocked, false if the page can be
+    // accessed right away or has to be faulted in synchronously.
+    bool faultAsync(PID pid);
+
     void evict();
+
+    bool wantsPromotion(PID pid) {
+        return store.fastSlots && store.slotOf[pid].load(std::memory_order_relaxed) == 0 &&
+               store.faultCount[pid].load(std::memory_order_relaxed) >= promoteFaults;
+    }
+
+    // Give a locked page a fast tier slot, it is written there from now on. Returns false if all slots are taken, then
+    // the clock hand looks for a page that was not faulted in from its slot for a rotation and is still evicted, and
+    // queues it for the demotion thread. Its slot is free for a later promotion once the page is moved.
+    bool promote(PID pid);
+
+    // copy an evicted page locked exclusively from its fast slot to the striped devices through buffer, free the slot
+    // and unlock the page
+    void demote(PID pid, u64 slot, Page *buffer);
+
+    void demotionThreadLoop();
+
+    // hint that a scan accessed the page for the last time, the page may be unlocked
+    void touchOnce(PID pid);
+
+    // release the memory of locked pages, sorts pids
+    void unmapPages(std::vector<PID> &pids);
+
+    void evictionThreadLoop(unsigned id);
+
+    // recompute freeLow and freeHigh from physCount
+    void updateWatermarks();
+
+    // called by eviction threads, frames they free are not refilled by foreground threads
+    void lowerForegroundCount();
+
+    // Change the number of frames to physBytes, at most PHYSGB_MAX. Shrinking evicts down to the new size, in the
+    // background if there are eviction threads and in the calling thread otherwise. Returns false if the size is out
+    // of range.
+    bool resize(u64 physBytes);
+
+    // restore allocCount, tree anchors and page 0 from the superblock, all other pages start out evicted
+    void reopen();
+
+    // Fuzzy checkpoint: write all dirty pages in pid order, then page 0 and the superblock.
+    // Concurrent modifications are allowed, but only those completed before the call are guaranteed to be written.
+    // Nothing quiesces structure modifications, a split or merge may be written with only some of its pages, so the
+    // image is only a consistent tree if there were none. Writes are throttled to maxBytesPerSecond if it is non-zero.
+    void sync(u64 maxBytesPerSecond = 0);
+
+    void checkpointThreadLoop();
+
+    void writeSuperblock();
+
+    // Store the free pids, including the unused ones of per-thread chunks, in a chain of free pages for the superblock.
+    // Written before the superblock, the previous chain is only freed once the superblock no longer references it.
+    void writeFreeList();
+
+    void readFreeList();
+
+    // Trees call this once on construction, in the same order in every run.
+    // The returned index identifies the tree's anchor in the superblock.
+    unsigned registerTree();
+
+    TreeFrames *treeOf(PID pid) {
+        u8 owner = pageOwner[pid].load(std::memory_order_relaxed);
+        return owner ? &treeFrames[owner - 1] : nullptr;
+    }
+
+    // A page became resident and is counted for its tree. Allocated pages are attributed to the current tree, faulted
+    // ones keep their tree if they have one.
+    void chargeTree(PID pid, bool fault);
+
+    // the page stops being resident
+    void unchargeTree(PID pid, bool evicted);
+
+    void setTreeQuota(unsigned tree, u64 bytes) { treeFrames[tree].quota = bytes / pageSize; }
+
+    void setTreePriority(unsigned tree, u8 priority) { treeFrames[tree].priority = priority; }
+
+    PID getTreeAnchor(unsigned tree) { return superblock.treeAnchors[tree]; }
+
+    void setTreeAnchor(unsigned tree, PID anchor) { superblock.treeAnchors[tree] = anchor; }
 };
 
 
@@ -342,6 +1088,13 @@ extern BufferManager bm;
 struct OLCRestartException {
 };
 
+// Thrown by optimistic reads of evicted pages while suspendFaults is set, after the read was submitted.
+// Not an OLCRestartException, operations do not retry it themselves, it unwinds to the AsyncScheduler which restarts
+// the operation once the page is resident. Only thrown where an OLCRestartException may be thrown as well.
+struct PageFaultSuspend {
+    PID pid;
+};
+
 template<class T>
 struct GuardO {
     T *ptr;
@@ -377,6 +1130,7 @@ struct GuardO {
 
     void init() {
         assert(ptr);
+        currentTreeAccesses++;
         PageState &ps = bm.getPageState(pid());
         for (u64 repeatCounter = 0;; repeatCounter++) {
             u64 v = ps.stateAndVersion.load();
@@ -394,8 +1148,13 @@ struct GuardO {
                     break;
                 }
                 case PageState::Locked:
+                    // usually one of the reads an AsyncScheduler waits for
+                    if (suspendFaults)
+                        throw PageFaultSuspend{pid()};
                     break;
                 case PageState::Evicted:
+                    if (suspendFaults && bm.faultAsync(pid()))
+                        throw PageFaultSuspend{pid()};
                     if (ps.tryLockX(v)) {
                         bm.handleFault(pid());
                         bm.unfixX(pid());
@@ -404,7 +1163,7 @@ struct GuardO {
                 default:
                     abort();
             }
-            vmcache_yield(repeatCounter);
+            ps.wait(v, repeatCounter);
         }
     }
 
@@ -506,7 +1265,7 @@ struct GuardX {
                     return;
                 }
             }
-            vmcache_yield(repeatCounter);
+            ps.wait(stateAndVersion, repeatCounter);
         }
     }
 
@@ -522,6 +1281,19 @@ struct GuardX {
         return r;
     }
 
+    static GuardX allocPinned() {
+        GuardX r;
+        r.ptr = reinterpret_cast<T *>(bm.allocPinnedPage());
+        return r;
+    }
+
+    // free the page and release the guard
+    void dealloc() {
+        assert(ptr);
+        bm.freePage(pid());
+        ptr = nullptr;
+    }
+
     // assignment operator
     GuardX &operator=(const GuardX &) = delete;
 
@@ -558,6 +1330,31 @@ struct GuardX {
     }
 };
 
+// Attributes the pages the calling thread allocates and faults in to a tree and counts its page accesses for it.
+// Trees open one in each operation.
+struct TreeScope {
+    uint16_t previousTree;
+    u64 previousAccesses;
+
+    explicit TreeScope(unsigned tree) : previousTree(currentTree), previousAccesses(currentTreeAccesses) {
+        currentTree = tree + 1;
+        currentTreeAccesses = 0;
+    }
+
+    ~TreeScope() {
+        bm.treeFrames[currentTree - 1].accesses.add(currentTreeAccesses);
+        currentTree = previousTree;
+        currentTreeAccesses = previousAccesses;
+    }
+};
+
+// Restores suspendFaults on exit. Scans clear it once they invoked callbacks, restarting them would repeat those.
+struct SuspendFaultsScope {
+    bool previous = suspendFaults;
+
+    ~SuspendFaultsScope() { suspendFaults = previous; }
+};
+
 template<class T>
 struct AllocGuard : public GuardX<T> {
     template<typename ...Params>
@@ -567,6 +1364,15 @@ struct AllocGuard : public GuardX<T> {
     }
 };
 
+template<class T>
+struct PinnedAllocGuard : public GuardX<T> {
+    template<typename ...Params>
+    PinnedAllocGuard(Params &&... params) {
+        GuardX<T>::ptr = reinterpret_cast<T *>(bm.allocPinnedPage());
+        new(GuardX<T>::ptr) T(std::forward<Params>(params)...);
+    }
+};
+
 
 template<class T>
 struct GuardS {
@@ -24,6 +24,7 @@
 #include <immintrin.h>
 #include "vmache.hpp"
 #include "vmcache_btree.hpp"
+#include "WriteAheadLog.hpp"
 
 using namespace std;
 
@@ -68,33 +69,54 @@ static_assert(sizeof(VmcBTreeNode) == pageSize, "btree node size problem");
 static unsigned btreeslotcounter = 0;
 
 VmcBTree::VmcBTree(bool isInt) : splitOrdered(false) {
+    slotId = btreeslotcounter++;
+    // roots are stored on page 0, which is restored on reopen
+    treeIndex = bm.registerTree();
+    TreeScope scope(treeIndex);
+    bm.setTreeAnchor(treeIndex, metadataPageId);
+    bm.store.pageGap = [](PID pid, Page *page) {
+        return pid == metadataPageId ? PageGap{0, 0} : reinterpret_cast<VmcBTreeNode *>(page)->gap();
+    };
+    if (bm.reopened) {
+        wal.replay(treeIndex, bm.superblock.checkpointLsn, [&](auto type, auto key, auto payload) {
+            if (type == WriteAheadLog::Insert)
+                insert(key, payload);
+            else
+                remove(key);
+        });
+        return;
+    }
     GuardX<MetaDataPage> page(metadataPageId);
     AllocGuard<VmcBTreeNode> rootNode(true);
-    slotId = btreeslotcounter++;
     page->roots[slotId] = rootNode.pid();
 }
 
 VmcBTree::~VmcBTree() {}
 
 void VmcBTree::trySplit(GuardX<VmcBTreeNode> &&node, GuardX<VmcBTreeNode> &&parent, span<u8> key, unsigned payloadLen) {
-
-    // create new root if necessary
-    if (parent.pid() == metadataPageId) {
-        MetaDataPage *metaData = reinterpret_cast<MetaDataPage *>(parent.ptr);
-        AllocGuard<VmcBTreeNode> newRoot(false);
-        newRoot->upperInnerNode = node.pid();
-        metaData->roots[slotId] = newRoot.pid();
-        parent = std::move(newRoot);
-    }
-
-    // split
     VmcBTreeNode::SeparatorInfo sepInfo = node->findSeparator(splitOrdered.load());
     u8 sepKey[sepInfo.len];
     node->getSep(sepKey, sepInfo);
+    {
+        // the metadata page stays locked until the split is logged
+        GuardX<VmcBTreeNode> metaData;
+        WriteAheadLog::StructureScope structure(treeIndex, {node.pid(), parent.pid()});
+        // create new root if necessary
+        if (parent.pid() == metadataPageId) {
+            PinnedAllocGuard<VmcBTreeNode> newRoot(false);
+            newRoot->upperInnerNode = node.pid();
+            reinterpret_cast<MetaDataPage *>(parent.ptr)->roots[slotId] = newRoot.pid();
+            metaData = std::move(parent);
+            parent = std::move(newRoot);
+        }
 
-    if (parent->hasSpaceFor(sepInfo.len, sizeof(PID))) {  // is there enough space in the parent for the separator?
-        node->splitNode(parent.ptr, sepInfo.slot, {sepKey, sepInfo.len});
-        return;
+        // split
+        if (parent->hasSpaceFor(sepInfo.len, sizeof(PID))) { // is there enough space in the parent for the separator?
+            node->splitNode(parent.ptr, sepInfo.slot, {sepKey, sepInfo.len});
+            return;
+        }
+        if (!metaData.ptr)
+            structure.cancel();
     }
 
     // must split parent to make space for separator, restart from root to do this
@@ -129,6 +151,7 @@ void VmcBTree::ensureSpace(VmcBTreeNode *toSplit, span<u8> key, unsigned payload
 
 void VmcBTree::insert(span<u8> key, span<u8> payload) {
     assert((key.size() + payload.size()) <= VmcBTreeNode::maxKVSize);
+    TreeScope scope(treeIndex);
 
     for (u64 repeatCounter = 0;; repeatCounter++) {
         try {
@@ -145,6 +168,7 @@ void VmcBTree::insert(span<u8> key, span<u8> payload) {
                 GuardX<VmcBTreeNode> nodeLocked(std::move(node));
                 parent.release();
                 nodeLocked->insertInPage(key, payload);
+                wal.logAndRelease(nodeLocked, WriteAheadLog::Insert, treeIndex, key, payload);
                 return; // success
             }
 
@@ -158,6 +182,7 @@ void VmcBTree::insert(span<u8> key, span<u8> payload) {
 }
 
 bool VmcBTree::remove(span<u8> key) {
+    TreeScope scope(treeIndex);
     for (u64 repeatCounter = 0;; repeatCounter++) {
         try {
             GuardO<VmcBTreeNode> parent(metadataPageId);
@@ -178,27 +203,109 @@ bool VmcBTree::remove(span<u8> key) {
 
             unsigned sizeEntry = node->slot[slotId].keyLen + node->slot[slotId].payloadLen;
             if ((node->freeSpaceAfterCompaction() + sizeEntry >= VmcBTreeNodeHeader::underFullSize) &&
-                (parent.pid() != metadataPageId) && (parent->count >= 2) && ((pos + 1) < parent->count)) {
+                (parent.pid() != metadataPageId) && (pos < parent->count)) {
                 // underfull
                 GuardX<VmcBTreeNode> parentLocked(std::move(parent));
                 GuardX<VmcBTreeNode> nodeLocked(std::move(node));
-                GuardX<VmcBTreeNode> rightLocked(parentLocked->getChild(pos + 1));
+                GuardX<VmcBTreeNode> rightLocked(pos + 1 == parentLocked->count ? parentLocked->upperInnerNode
+                                                                                : parentLocked->getChild(pos + 1));
                 nodeLocked->removeSlot(slotId);
+                bool merged = false;
                 if (rightLocked->freeSpaceAfterCompaction() >= VmcBTreeNodeHeader::underFullSize) {
+                    WriteAheadLog::StructureScope structure(treeIndex, {parentLocked.pid(), nodeLocked.pid()});
                     if (nodeLocked->mergeNodes(pos, parentLocked.ptr, rightLocked.ptr)) {
+                        // right was merged into node
+                        rightLocked.dealloc();
+                        merged = true;
+                    } else {
+                        structure.cancel();
                     }
                 }
+                VmcBTreeNode *parentPtr = parentLocked.ptr;
+                bool parentUnderfull =
+                        merged && parentLocked->freeSpaceAfterCompaction() >= VmcBTreeNodeHeader::underFullSize;
+                rightLocked.release();
+                parentLocked.release();
+                wal.logAndRelease(nodeLocked, WriteAheadLog::Remove, treeIndex, key, {});
+                if (parentUnderfull)
+                    mergeInner(parentPtr, key);
             } else {
                 GuardX<VmcBTreeNode> nodeLocked(std::move(node));
                 parent.release();
                 nodeLocked->removeSlot(slotId);
+                wal.logAndRelease(nodeLocked, WriteAheadLog::Remove, treeIndex, key, {});
             }
             return true;
         } catch (const OLCRestartException &) { vmcache_yield(repeatCounter); }
     }
 }
 
+void VmcBTree::mergeInner(VmcBTreeNode *toMerge, span<u8> key) {
+    for (u64 repeatCounter = 0;; repeatCounter++) {
+        try {
+            GuardO<VmcBTreeNode> parent(metadataPageId);
+            GuardO<VmcBTreeNode> node(reinterpret_cast<MetaDataPage *>(parent.ptr)->getRoot(slotId), parent);
+
+            u16 pos = 0;
+            while (node->isInner() && (node.ptr != toMerge)) {
+                parent = std::move(node);
+                pos = parent->lowerBound(key);
+                node = GuardO<VmcBTreeNode>(parent->lookupInner(key), parent);
+            }
+            if (node.ptr != toMerge)
+                return; // merged concurrently
+
+            if (parent.pid() == metadataPageId) {
+                // a root left with a single child is replaced by that child
+                if (node->count > 0)
+                    return;
+                GuardX<VmcBTreeNode> metaLocked(std::move(parent));
+                GuardX<VmcBTreeNode> rootLocked(std::move(node));
+                WriteAheadLog::StructureScope structure(treeIndex, {metaLocked.pid()});
+                reinterpret_cast<MetaDataPage *>(metaLocked.ptr)->roots[slotId] = rootLocked->upperInnerNode;
+                rootLocked.dealloc();
+                return;
+            }
+            if (node->freeSpaceAfterCompaction() < VmcBTreeNodeHeader::underFullSize)
+                return;
+
+            GuardX<VmcBTreeNode> parentLocked(std::move(parent));
+            if (parentLocked->count == 0) {
+                // no sibling, merge the parent first
+                toMerge = parentLocked.ptr;
+                continue;
+            }
+            // lock left before right, merge into the left node
+            unsigned separator;
+            GuardX<VmcBTreeNode> left;
+            GuardX<VmcBTreeNode> right;
+            if (pos < parentLocked->count) {
+                separator = pos;
+                left = GuardX<VmcBTreeNode>(std::move(node));
+                right = GuardX<VmcBTreeNode>(pos + 1 == parentLocked->count ? parentLocked->upperInnerNode
+                                                                            : parentLocked->getChild(pos + 1));
+            } else {
+                separator = pos - 1;
+                left = GuardX<VmcBTreeNode>(parentLocked->getChild(pos - 1));
+                right = GuardX<VmcBTreeNode>(std::move(node));
+            }
+            {
+                WriteAheadLog::StructureScope structure(treeIndex, {parentLocked.pid(), left.pid()});
+                if (!left->mergeNodes(separator, parentLocked.ptr, right.ptr)) {
+                    structure.cancel();
+                    return;
+                }
+                right.dealloc();
+            }
+            if (parentLocked->freeSpaceAfterCompaction() < VmcBTreeNodeHeader::underFullSize)
+                return;
+            toMerge = parentLocked.ptr;
+        } catch (const OLCRestartException &) { vmcache_yield(repeatCounter); }
+    }
+}
+
 int VmcBTree::lookup(std::span<u8> key, u8 *payloadOut, unsigned int payloadOutSize) {
+    TreeScope scope(treeIndex);
     for (u64 repeatCounter = 0;; repeatCounter++) {
         try {
             GuardO<VmcBTreeNode> node = findLeafO(key);
@@ -452,28 +559,35 @@ void VmcBTreeNode::compactify() {
 }
 
 bool VmcBTreeNode::mergeNodes(unsigned int slotId, VmcBTreeNode *parent, VmcBTreeNode *right) {
-    if (!isLeaf)
-        // TODO: implement inner merge
-        return true;
-
-    assert(right->isLeaf);
+    assert(isLeaf == right->isLeaf);
     assert(parent->isInner());
     VmcBTreeNode tmp(isLeaf);
     tmp.setFences(getLowerFence(), right->getUpperFence());
     unsigned leftGrow = (prefixLen - tmp.prefixLen) * count;
     unsigned rightGrow = (right->prefixLen - tmp.prefixLen) * right->count;
+    // inner nodes pull the separator down from the parent, it is the upper fence of this node
+    unsigned separatorSpace = isLeaf ? 0 : sizeof(Slot) + upperFence.len + sizeof(PID);
     unsigned spaceUpperBound =
             spaceUsed + right->spaceUsed + (reinterpret_cast<u8 *>(slot + count + right->count) - ptr()) + leftGrow +
-            rightGrow;
+            rightGrow + separatorSpace;
     if (spaceUpperBound > pageSize)
         return false;
     copyKeyValueRange(&tmp, 0, 0, count);
-    right->copyKeyValueRange(&tmp, count, 0, right->count);
+    if (isLeaf) {
+        tmp.nextLeafNode = right->nextLeafNode;
+    } else {
+        tmp.storeKeyValue(tmp.count, getUpperFence(), {reinterpret_cast<u8 *>(&upperInnerNode), sizeof(PID)});
+        tmp.count++;
+        tmp.upperInnerNode = right->upperInnerNode;
+    }
+    right->copyKeyValueRange(&tmp, tmp.count, 0, right->count);
     PID pid = bm.toPID(this);
-    memcpy(parent->getPayload(slotId + 1).data(), &pid, sizeof(PID));
+    if (slotId + 1 == parent->count)
+        parent->upperInnerNode = pid;
+    else
+        memcpy(parent->getPayload(slotId + 1).data(), &pid, sizeof(PID));
     parent->removeSlot(slotId);
     tmp.makeHint();
-    tmp.nextLeafNode = right->nextLeafNode;
 
     copyNode(this, &tmp);
     return true;
@@ -550,7 +664,11 @@ void VmcBTreeNode::splitNode(VmcBTreeNode *parent, unsigned int sepSlot, std::sp
     VmcBTreeNode tmp(isLeaf);
     VmcBTreeNode *nodeLeft = &tmp;
 
-    AllocGuard<VmcBTreeNode> newNode(isLeaf);
+    GuardX<VmcBTreeNode> newNode;
+    if (isLeaf)
+        newNode = AllocGuard<VmcBTreeNode>(isLeaf);
+    else
+        newNode = PinnedAllocGuard<VmcBTreeNode>(isLeaf);
     VmcBTreeNode *nodeRight = newNode.ptr;
 
     nodeLeft->setFences(getLowerFence(), sep);
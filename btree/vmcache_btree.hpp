@@ -79,6 +79,8 @@ struct VmcBTreeNode : public VmcBTreeNodeHeader {
 
     unsigned freeSpace() { return dataOffset - (reinterpret_cast<u8 *>(slot + count) - ptr()); }
 
+    PageGap gap() { return {dataOffset - freeSpace(), dataOffset}; }
+
     unsigned freeSpaceAfterCompaction() {
         return pageSize - (reinterpret_cast<u8 *>(slot + count) - ptr()) - spaceUsed;
     }
@@ -160,15 +162,28 @@ private:
 
     void ensureSpace(VmcBTreeNode *toSplit, std::span<u8> key, unsigned payloadLen);
 
+    // merge the underfull inner node toMerge with a sibling, then its ancestors, and collapse a root with one child
+    void mergeInner(VmcBTreeNode *toMerge, std::span<u8> key);
+
+    // release a leaf a scan is done with and hint it as touched once
+    static void releaseScanned(GuardS<VmcBTreeNode> &node) {
+        PID pid = node.pid();
+        node.release();
+        bm.touchOnce(pid);
+    }
+
 public:
     void lookupImpl(std::span<uint8_t> key, std::function<void(std::span<uint8_t>)> callback);
 
     void insertImpl(std::span<uint8_t> key, std::span<uint8_t> payload);
 
+    bool removeImpl(std::span<uint8_t> key) { return remove(key); }
+
     void range_lookupImpl(std::span<uint8_t> key, uint8_t *keyOutBuffer,
                           const std::function<bool(unsigned int, std::span<uint8_t>)> &found_record_cb);
 
     unsigned slotId;
+    unsigned treeIndex;
     std::atomic<bool> splitOrdered;
 
     VmcBTree(bool isInt);
@@ -190,6 +205,7 @@ public:
 
     template<class Fn>
     bool lookup(std::span<u8> key, Fn fn) {
+        TreeScope scope(treeIndex);
         for (u64 repeatCounter = 0;; repeatCounter++) {
             try {
                 GuardO<VmcBTreeNode> node = findLeafO(key);
@@ -211,6 +227,7 @@ public:
 
     template<class Fn>
     bool updateInPlace(std::span<u8> key, Fn fn) {
+        TreeScope scope(treeIndex);
         for (u64 repeatCounter = 0;; repeatCounter++) {
             try {
                 GuardO<VmcBTreeNode> node = findLeafO(key);
@@ -245,26 +262,32 @@ public:
 
     template<class Fn>
     void scanAsc(std::span<u8> key, Fn fn) {
+        TreeScope scope(treeIndex);
         GuardS<VmcBTreeNode> node = findLeafS(key);
         bool found;
         unsigned pos = node->lowerBound(key, found);
         for (u64 repeatCounter = 0;; repeatCounter++) { // XXX
             if (pos < node->count) {
                 if (!fn(*node.ptr, pos))
-                    return;
+                    return releaseScanned(node);
                 pos++;
             } else {
                 if (!node->hasRightNeighbour())
-                    return;
+                    return releaseScanned(node);
                 pos = 0;
+                PID scanned = node.pid();
                 node = GuardS<VmcBTreeNode>(node->nextLeafNode);
+                bm.touchOnce(scanned);
             }
         }
     }
 
     template<class Fn>
     void scanDesc(std::span<u8> key, Fn fn) {
+        TreeScope scope(treeIndex);
         GuardS<VmcBTreeNode> node = findLeafS(key);
+        SuspendFaultsScope suspendScope;
+        suspendFaults = false;
         bool exactMatch;
         int pos = node->lowerBound(key, exactMatch);
         if (pos == node->count) {
@@ -274,12 +297,14 @@ public:
         for (u64 repeatCounter = 0;; repeatCounter++) { // XXX
             while (pos >= 0) {
                 if (!fn(*node.ptr, pos, exactMatch))
-                    return;
+                    return releaseScanned(node);
                 pos--;
             }
             if (!node->hasLowerFence())
-                return;
+                return releaseScanned(node);
+            PID scanned = node.pid();
             node = findLeafS(node->getLowerFence());
+            bm.touchOnce(scanned);
             pos = node->count - 1;
         }
     }